@@ -8,6 +8,17 @@ ClassImp(AliAnalysisQuickTask);
 AliAnalysisQuickTask::AliAnalysisQuickTask()
     : AliAnalysisTaskSE(),
       //   fIsMC(0),
+      fPrescaleEvents(1.),
+      fPrescalePairs(1.),
+      fPrescaleSeed(0),
+      fProcessFullMCStack(kFALSE),
+      fWriteSkim(kFALSE),
+      fCutsOption(""),
+      fCheckpointDir(""),
+      fV0HypothesesOption("AntiLambda"),
+      fMixingHypothesisOption("AntiLambda"),
+      fMixingDepth(0),
+      fSVHypothesesOption(""),
       fPDG(),
       fLogTree(0),
       fOutputListOfTrees(0),
@@ -15,24 +26,42 @@ AliAnalysisQuickTask::AliAnalysisQuickTask()
       fMC(0),
       fESD(0),
       fPIDResponse(0),
-      kMin_Track_P(0.),
-      kMax_Track_P(0.),
-      kMax_Track_Eta(0.),
-      kMin_Track_NTPCClusters(0.),
-      kMax_Track_Chi2PerNTPCClusters(0.),
-      kMin_V0_Mass(0.),
-      kMax_V0_Mass(0.),
-      kMin_V0_Pt(0.),
-      kMax_V0_Eta(0.),
-      kMin_V0_CPAwrtPV(0.),
-      kMax_V0_CPAwrtPV(0.),
-      kMax_V0_DCAwrtPV(0.),
-      kMax_V0_DCAbtwDau(0.),
-      kMax_V0_DCAnegV0(0.),
-      kMax_V0_DCAposV0(0.),
-      kMax_V0_ArmPtOverAlpha(0.),
-      kMax_V0_Chi2ndf(0.) {
-    //
+      fSkimTree(0),
+      fSpeciesOfNegDaughters(0),
+      fSpeciesOfPosDaughters(0),
+      kGrid_CellSize(0.),
+      fCostTree(0),
+      fCost_FileName(),
+      fCost_NEvents(0),
+      fCost_NProcessedEvents(0),
+      fCost_NTracks(0),
+      fCost_NPairs(0),
+      fCost_LogTime(0.),
+      fCost_RealTime(0.),
+      fCost_CpuTime(0.),
+      fCost_Stopwatch(),
+      fFileHash(0),
+      fEventHash(0),
+      fEventWeight(1.),
+      fPairWeight(1.),
+      kPrescale_MinPairs(0),
+      fMixingHypothesis(),
+      fMixingPool(),
+      fMixingPoolNTracks(),
+      fMixingPoolNEvents(),
+      fMixingPoolNextSlot(),
+      kMixing_NBinsZ(0),
+      kMixing_MaxAbsZ(0.),
+      kMixing_MultEdges(),
+      kMixing_MaxTracksPerEvent(0),
+      kGrid_SegmentLength(0.),
+      fCheckpointedFiles(),
+      fCheckpointOutputs(),
+      fCheckpointsToMerge(),
+      fSkipCurrentFile(kFALSE),
+      fTrackCuts(),
+      fTrackCutKernel(0) {
+    ClearContainers();
 }
 
 /*
@@ -41,6 +70,17 @@ AliAnalysisQuickTask::AliAnalysisQuickTask()
 AliAnalysisQuickTask::AliAnalysisQuickTask(const char* name)
     : AliAnalysisTaskSE(name),
       //   fIsMC(0),
+      fPrescaleEvents(1.),
+      fPrescalePairs(1.),
+      fPrescaleSeed(0),
+      fProcessFullMCStack(kFALSE),
+      fWriteSkim(kFALSE),
+      fCutsOption(""),
+      fCheckpointDir(""),
+      fV0HypothesesOption("AntiLambda"),
+      fMixingHypothesisOption("AntiLambda"),
+      fMixingDepth(0),
+      fSVHypothesesOption(""),
       fPDG(),
       fLogTree(0),
       fOutputListOfTrees(0),
@@ -48,23 +88,42 @@ AliAnalysisQuickTask::AliAnalysisQuickTask(const char* name)
       fMC(0),
       fESD(0),
       fPIDResponse(0),
-      kMin_Track_P(0.),
-      kMax_Track_P(0.),
-      kMax_Track_Eta(0.),
-      kMin_Track_NTPCClusters(0.),
-      kMax_Track_Chi2PerNTPCClusters(0.),
-      kMin_V0_Mass(0.),
-      kMax_V0_Mass(0.),
-      kMin_V0_Pt(0.),
-      kMax_V0_Eta(0.),
-      kMin_V0_CPAwrtPV(0.),
-      kMax_V0_CPAwrtPV(0.),
-      kMax_V0_DCAwrtPV(0.),
-      kMax_V0_DCAbtwDau(0.),
-      kMax_V0_DCAnegV0(0.),
-      kMax_V0_DCAposV0(0.),
-      kMax_V0_ArmPtOverAlpha(0.),
-      kMax_V0_Chi2ndf(0.) {
+      fSkimTree(0),
+      fSpeciesOfNegDaughters(0),
+      fSpeciesOfPosDaughters(0),
+      kGrid_CellSize(0.),
+      fCostTree(0),
+      fCost_FileName(),
+      fCost_NEvents(0),
+      fCost_NProcessedEvents(0),
+      fCost_NTracks(0),
+      fCost_NPairs(0),
+      fCost_LogTime(0.),
+      fCost_RealTime(0.),
+      fCost_CpuTime(0.),
+      fCost_Stopwatch(),
+      fFileHash(0),
+      fEventHash(0),
+      fEventWeight(1.),
+      fPairWeight(1.),
+      kPrescale_MinPairs(0),
+      fMixingHypothesis(),
+      fMixingPool(),
+      fMixingPoolNTracks(),
+      fMixingPoolNEvents(),
+      fMixingPoolNextSlot(),
+      kMixing_NBinsZ(0),
+      kMixing_MaxAbsZ(0.),
+      kMixing_MultEdges(),
+      kMixing_MaxTracksPerEvent(0),
+      kGrid_SegmentLength(0.),
+      fCheckpointedFiles(),
+      fCheckpointOutputs(),
+      fCheckpointsToMerge(),
+      fSkipCurrentFile(kFALSE),
+      fTrackCuts(),
+      fTrackCutKernel(0) {
+    ClearContainers();
     DefineInput(0, TChain::Class());
     DefineOutput(1, TList::Class());  // fOutputListOfTrees
     DefineOutput(2, TList::Class());  // fOutputListOfHists
@@ -95,6 +154,42 @@ void AliAnalysisQuickTask::UserCreateOutputObjects() {
 
     /** Prepare Output **/
 
+    PrepareV0Hypotheses();
+    PrepareSVHypotheses();
+
+    PrepareOutputLists();
+
+    DefineTracksCuts(fCutsOption);
+    DefineV0Cuts(fCutsOption);
+    DefineSVCuts(fCutsOption);
+
+    if (fMixingDepth > 0) PrepareEventMixing();
+
+    if (fPrescaleEvents < 1. || fPrescalePairs < 1.) PreparePrescale();
+
+    // always, so the outputs of preview and full-statistics runs have the same structure and can be merged
+    TIter nextHist(fOutputListOfHists);
+    while (TObject* obj = nextHist()) {
+        if (obj->InheritsFrom(TH1::Class())) static_cast<TH1*>(obj)->Sumw2();
+    }
+
+    if (fCheckpointDir != "") LoadCheckpointManifest();
+
+    PostData(1, fOutputListOfTrees);
+    PostData(2, fOutputListOfHists);
+
+    if (fWriteSkim) {
+        PrepareSkimTree();
+        PostData(3, fSkimTree);
+    }
+}
+
+/*
+ Create the output lists and the objects they hold.
+ Separated from `UserCreateOutputObjects()` so it can also be used by `ReplaySkim()`, without an analysis manager.
+*/
+void AliAnalysisQuickTask::PrepareOutputLists() {
+
     /* Trees */
 
     fOutputListOfTrees = new TList();
@@ -103,6 +198,17 @@ void AliAnalysisQuickTask::UserCreateOutputObjects() {
     fLogTree = new TTree("Injected", "Injected");
     fOutputListOfTrees->Add(fLogTree);
 
+    fCostTree = new TTree("FileCost", "FileCost");
+    fCostTree->Branch("FileName", fCost_FileName, "FileName/C");
+    fCostTree->Branch("NEvents", &fCost_NEvents, "NEvents/L");
+    fCostTree->Branch("NProcessedEvents", &fCost_NProcessedEvents, "NProcessedEvents/L");
+    fCostTree->Branch("NTracks", &fCost_NTracks, "NTracks/L");
+    fCostTree->Branch("NPairs", &fCost_NPairs, "NPairs/L");
+    fCostTree->Branch("LogTime", &fCost_LogTime, "LogTime/D");
+    fCostTree->Branch("RealTime", &fCost_RealTime, "RealTime/D");
+    fCostTree->Branch("CpuTime", &fCost_CpuTime, "CpuTime/D");
+    fOutputListOfTrees->Add(fCostTree);
+
     /* Histograms */
 
     fOutputListOfHists = new TList();
@@ -120,11 +226,44 @@ void AliAnalysisQuickTask::UserCreateOutputObjects() {
     fHist_Tracks_Status = new TH1F("Status", "", 20, 0., 20);
     fOutputListOfHists->Add(fHist_Tracks_Status);
 
-    fHist_AntiLambda_Mass = new TH1F("AntiLambda_Mass", "", 100, 0.5, 1.5);
-    fOutputListOfHists->Add(fHist_AntiLambda_Mass);
+    const Char_t* TrackCutStageLabels[kNTrackCutStages] = {"Tracks", "Eta", "NTPCClusters", "InnerParam", "P", "Chi2PerNTPCClusters"};
 
-    PostData(1, fOutputListOfTrees);
-    PostData(2, fOutputListOfHists);
+    fHist_Tracks_CutFlow = new TH1F("Tracks_CutFlow", "", kNTrackCutStages, 0., kNTrackCutStages);
+    for (Int_t stage = 0; stage < kNTrackCutStages; stage++) fHist_Tracks_CutFlow->GetXaxis()->SetBinLabel(stage + 1, TrackCutStageLabels[stage]);
+    fOutputListOfHists->Add(fHist_Tracks_CutFlow);
+
+    const Char_t* CutStageLabels[kNV0CutStages] = {"Pairs",    "DCAbtwDau", "Mass",     "Pt",       "Eta",           "Chi2ndf",
+                                                   "CPAwrtPV", "DCAwrtPV",  "DCAnegV0", "DCAposV0", "ArmPtOverAlpha"};
+
+    for (QuickV0Hypothesis& hyp : fV0Hypotheses) {
+
+        hyp.Hist_Mass = new TH1F(Form("%s_Mass", hyp.Name.Data()), "", 100, hyp.HistMinMass, hyp.HistMaxMass);
+        fOutputListOfHists->Add(hyp.Hist_Mass);
+
+        hyp.Hist_CutFlow = new TH1F(Form("%s_CutFlow", hyp.Name.Data()), "", kNV0CutStages, 0., kNV0CutStages);
+        for (Int_t stage = 0; stage < kNV0CutStages; stage++) hyp.Hist_CutFlow->GetXaxis()->SetBinLabel(stage + 1, CutStageLabels[stage]);
+        fOutputListOfHists->Add(hyp.Hist_CutFlow);
+    }
+
+    const Char_t* SVCutStageLabels[kNSVCutStages] = {"AllPairs", "GridPairs", "SharedDau", "DCAbtwDau", "DistanceFromPV",
+                                                     "Mass",     "Pt",        "CPAwrtPV",  "DCAwrtPV",  "Chi2ndf"};
+
+    for (QuickSVHypothesis& hyp : fSVHypotheses) {
+
+        hyp.Hist_Mass = new TH1F(Form("%s_Mass", hyp.Name.Data()), "", 100, hyp.HistMinMass, hyp.HistMaxMass);
+        fOutputListOfHists->Add(hyp.Hist_Mass);
+
+        hyp.Hist_CutFlow = new TH1F(Form("%s_CutFlow", hyp.Name.Data()), "", kNSVCutStages, 0., kNSVCutStages);
+        for (Int_t stage = 0; stage < kNSVCutStages; stage++) hyp.Hist_CutFlow->GetXaxis()->SetBinLabel(stage + 1, SVCutStageLabels[stage]);
+        fOutputListOfHists->Add(hyp.Hist_CutFlow);
+    }
+
+    fHist_Arena_UsedMemory = new TH1F("Arena_UsedMemory", "", 200, 0., 20000.);
+    fOutputListOfHists->Add(fHist_Arena_UsedMemory);
+
+    fParam_Arena_HighWaterMark = new TParameter<Long64_t>("Arena_HighWaterMark", 0);
+    fParam_Arena_HighWaterMark->SetMergeMode('M');  // keep the max. when merging outputs
+    fOutputListOfHists->Add(fParam_Arena_HighWaterMark);
 }
 
 /*
@@ -134,10 +273,16 @@ void AliAnalysisQuickTask::UserCreateOutputObjects() {
 */
 void AliAnalysisQuickTask::UserExec(Option_t*) {
 
+    if (fSkipCurrentFile) return;
+
+    fCost_NEvents++;
+
     if (fIsFirstEvent) {
         if (fAliEnPath == "") AliInfo("!! No luck finding fAliEnPath !!");
         AliInfoF("!! fAliEnPath: %s !!", fAliEnPath.Data());
+        TStopwatch logStopwatch;
         if (LoadLogsIntoTree()) fLogTree->Print();
+        fCost_LogTime += logStopwatch.RealTime();
         fIsFirstEvent = kFALSE;
     }
 
@@ -152,27 +297,41 @@ void AliAnalysisQuickTask::UserExec(Option_t*) {
     fESD = dynamic_cast<AliESDEvent*>(InputEvent());
     if (!fESD) return;
 
+    if (!PassesEventPrescale()) return;
+
     fMagneticField = fESD->GetMagneticField();
 
     fPrimaryVertex = const_cast<AliESDVertex*>(fESD->GetPrimaryVertex());
 
-    DefineTracksCuts("");
-    DefineV0Cuts("");
-
-    ProcessMCGen();
+    if (fProcessFullMCStack) ProcessMCGen();
 
     ProcessTracks();
 
+    fCost_NProcessedEvents++;
+    fCost_NTracks += esdIndicesOfNegTracks.size() + esdIndicesOfPosTracks.size();
+    fCost_NPairs += (Long64_t)esdIndicesOfNegTracks.size() * (Long64_t)esdIndicesOfPosTracks.size();
+
+    ResolveMCLabels();
+
     KalmanV0Finder();
 
+    if (fMixingDepth > 0) EventMixing();
+
+    if (!fSVHypotheses.empty()) SecondaryVertexFinder();
+
+    if (fWriteSkim) FillSkimTree();
+
     /* Clear Containers */
 
-    getPdgCode_fromMcIdx.clear();
-    esdIndicesOfAntiProtonTracks.clear();
-    esdIndicesOfPiPlusTracks.clear();
+    fHist_Arena_UsedMemory->Fill(fArena.GetBytesInUse() / 1024.);  // unweighted, it describes the processed events
+
+    ClearContainers();
+
+    fParam_Arena_HighWaterMark->SetVal((Long64_t)fArena.GetHighWaterMark());
 
     PostData(1, fOutputListOfTrees);
     PostData(2, fOutputListOfHists);
+    if (fWriteSkim) PostData(3, fSkimTree);
 }
 
 /*
@@ -186,46 +345,215 @@ Bool_t AliAnalysisQuickTask::UserNotify() {
     if (!man_tree) AliFatal("!! Analysis Manager Tree not found !!");
     TFile* man_file = man_tree->GetCurrentFile();
     if (!man_file) AliFatal("!! Analysis Manager File not found !!");
+
+    /* At a file boundary, the previous file is complete */
+
+    Bool_t isNewFile = fAliEnPath != man_file->GetName();
+
+    if (isNewFile && fAliEnPath != "" && !fSkipCurrentFile) {
+        FillFileCost();
+        if (fCheckpointDir != "") WriteCheckpoint(fAliEnPath);
+    }
+
+    if (isNewFile && fCheckpointDir != "") {
+        TString checkpoint = FindCheckpoint(man_file->GetName());
+        fSkipCurrentFile = checkpoint != "";
+        if (fSkipCurrentFile) {
+            AliInfoF("!! Skipping %s, completed by a previous run !!", man_file->GetName());
+            fCheckpointsToMerge.push_back(checkpoint);
+        }
+    }
+
     fAliEnPath = man_file->GetName();
     AliInfoF("!! Loaded AliEn Path: %s !!", fAliEnPath.Data());
 
+    // the directory of the file identifies it, both on the grid and in local copies, e.g. ".../297595/001/AliESDs.root"
+    fFileHash = TString(gSystem->BaseName(gSystem->DirName(fAliEnPath))).Hash();
+
     fIsFirstEvent = kTRUE;
 
+    if (isNewFile) StartFileCost();
+
     return kTRUE;
 }
 
 /*
- Define track selection cuts.
+ Called once after the last event, before the outputs are written. Record the cost of the last file.
+ When checkpointing, flush the last file, then bring back the partial outputs of the input files of this run, including the ones
+ that were skipped because a previous run completed them. The partial outputs of the other files in the manifest are left out.
+*/
+void AliAnalysisQuickTask::FinishTaskOutput() {
+
+    if (fAliEnPath != "" && !fSkipCurrentFile) FillFileCost();
+
+    if (fCheckpointDir == "") {
+        PostData(1, fOutputListOfTrees);
+        return;
+    }
+
+    if (fAliEnPath != "" && !fSkipCurrentFile) WriteCheckpoint(fAliEnPath);
+    fSkipCurrentFile = kFALSE;
+
+    MergeCheckpoints();
+
+    PostData(1, fOutputListOfTrees);
+    PostData(2, fOutputListOfHists);
+}
+
+/*
+ Called once at the end, on the merged outputs. Report how much the spatial index pruned, from the cut flow of each secondary-vertex hypothesis.
+*/
+void AliAnalysisQuickTask::Terminate(Option_t* option) {
+
+    TList* hists = dynamic_cast<TList*>(GetOutputData(2));
+    if (!hists) return;
+
+    TIter next(hists);
+    while (TObject* obj = next()) {
+        TH1* hist = dynamic_cast<TH1*>(obj);
+        if (!hist || !TString(hist->GetName()).EndsWith("_CutFlow")) continue;
+        if (TString(hist->GetXaxis()->GetBinLabel(kSVStage_GridPairs + 1)) != "GridPairs") continue;  // a V0 cut flow
+        Double_t allPairs = hist->GetBinContent(kSVStage_AllPairs + 1);
+        Double_t gridPairs = hist->GetBinContent(kSVStage_GridPairs + 1);
+        AliInfoF("!! %s: %.0f of %.0f combinations found by the spatial index (%.1f%%) !!", hist->GetName(), gridPairs, allPairs,
+                 allPairs ? 100. * gridPairs / allPairs : 0.);
+    }
+}
+
+/*
+ Define track selection cuts, and pick the cut kernel.
  - Input: `cuts_option`
 */
 void AliAnalysisQuickTask::DefineTracksCuts(TString cuts_option) {
-    kMin_Track_P = 0.3;
-    kMax_Track_P = 5.;
-    kMax_Track_Eta = 0.8;
-    kMin_Track_NTPCClusters = 50;
-    kMax_Track_Chi2PerNTPCClusters = 7.;
+
+    fTrackCuts.kMin_Track_P = 0.3;
+    fTrackCuts.kMax_Track_P = 5.;
+    fTrackCuts.kMax_Track_Eta = 0.8;
+    fTrackCuts.kMin_Track_NTPCClusters = 50;
+    fTrackCuts.kMax_Track_Chi2PerNTPCClusters = 7.;
+
+    Int_t preset = cuts_option.Contains("loose") ? kTrackPreset_Loose : kTrackPreset_Standard;
+    fTrackCutKernel = GetTrackCutKernel(preset, cuts_option.Contains("float"));
+}
+
+/*
+ - Input: `preset`, `singlePrecision`
+ - Return: the pre-instantiated track cut kernel
+*/
+QuickTrackCutKernel AliAnalysisQuickTask::GetTrackCutKernel(Int_t preset, Bool_t singlePrecision) {
+    switch (preset) {
+        case kTrackPreset_Loose:
+            return singlePrecision ? &QuickTrackPreset_Loose<Float_t>::Chain::Pass<AliESDtrack, QuickTrackCuts>
+                                   : &QuickTrackPreset_Loose<Double_t>::Chain::Pass<AliESDtrack, QuickTrackCuts>;
+        default:
+            return singlePrecision ? &QuickTrackPreset_Standard<Float_t>::Chain::Pass<AliESDtrack, QuickTrackCuts>
+                                   : &QuickTrackPreset_Standard<Double_t>::Chain::Pass<AliESDtrack, QuickTrackCuts>;
+    }
+}
+
+/*
+ - Input: `preset`, `singlePrecision`
+ - Output: `pairKernel`, `kinematicKernel`, `topologicalKernel`, the pre-instantiated V0 cut kernels
+*/
+void AliAnalysisQuickTask::GetV0CutKernels(Int_t preset, Bool_t singlePrecision, QuickV0CutKernel& pairKernel, QuickV0CutKernel& kinematicKernel,
+                                           QuickV0CutKernel& topologicalKernel) {
+    switch (preset) {
+        case kV0Preset_KaonZeroShort:
+            pairKernel = singlePrecision ? &QuickV0Preset_KaonZeroShort<Float_t>::Pair::Pass<QuickV0CutInput, QuickV0Hypothesis>
+                                         : &QuickV0Preset_KaonZeroShort<Double_t>::Pair::Pass<QuickV0CutInput, QuickV0Hypothesis>;
+            kinematicKernel = singlePrecision ? &QuickV0Preset_KaonZeroShort<Float_t>::Kinematic::Pass<QuickV0CutInput, QuickV0Hypothesis>
+                                              : &QuickV0Preset_KaonZeroShort<Double_t>::Kinematic::Pass<QuickV0CutInput, QuickV0Hypothesis>;
+            topologicalKernel = singlePrecision ? &QuickV0Preset_KaonZeroShort<Float_t>::Topological::Pass<QuickV0CutInput, QuickV0Hypothesis>
+                                                : &QuickV0Preset_KaonZeroShort<Double_t>::Topological::Pass<QuickV0CutInput, QuickV0Hypothesis>;
+            break;
+        case kV0Preset_Open:
+            pairKernel = singlePrecision ? &QuickV0Preset_Open<Float_t>::Pair::Pass<QuickV0CutInput, QuickV0Hypothesis>
+                                         : &QuickV0Preset_Open<Double_t>::Pair::Pass<QuickV0CutInput, QuickV0Hypothesis>;
+            kinematicKernel = singlePrecision ? &QuickV0Preset_Open<Float_t>::Kinematic::Pass<QuickV0CutInput, QuickV0Hypothesis>
+                                              : &QuickV0Preset_Open<Double_t>::Kinematic::Pass<QuickV0CutInput, QuickV0Hypothesis>;
+            topologicalKernel = singlePrecision ? &QuickV0Preset_Open<Float_t>::Topological::Pass<QuickV0CutInput, QuickV0Hypothesis>
+                                                : &QuickV0Preset_Open<Double_t>::Topological::Pass<QuickV0CutInput, QuickV0Hypothesis>;
+            break;
+        default:
+            pairKernel = singlePrecision ? &QuickV0Preset_Lambda<Float_t>::Pair::Pass<QuickV0CutInput, QuickV0Hypothesis>
+                                         : &QuickV0Preset_Lambda<Double_t>::Pair::Pass<QuickV0CutInput, QuickV0Hypothesis>;
+            kinematicKernel = singlePrecision ? &QuickV0Preset_Lambda<Float_t>::Kinematic::Pass<QuickV0CutInput, QuickV0Hypothesis>
+                                              : &QuickV0Preset_Lambda<Double_t>::Kinematic::Pass<QuickV0CutInput, QuickV0Hypothesis>;
+            topologicalKernel = singlePrecision ? &QuickV0Preset_Lambda<Float_t>::Topological::Pass<QuickV0CutInput, QuickV0Hypothesis>
+                                                : &QuickV0Preset_Lambda<Double_t>::Topological::Pass<QuickV0CutInput, QuickV0Hypothesis>;
+            break;
+    }
+}
+
+/*
+ - Input: `preset`
+ - Return: kTRUE if its pair chain cuts on the DCA between daughters, which then has to be computed for the pair
+*/
+Bool_t AliAnalysisQuickTask::V0PresetNeedsDCAbtwDau(Int_t preset) {
+    switch (preset) {
+        case kV0Preset_KaonZeroShort:
+            return QuickV0Preset_KaonZeroShort<Double_t>::Pair::Has<QuickV0Cut_DCAbtwDau>::value;
+        case kV0Preset_Open:
+            return QuickV0Preset_Open<Double_t>::Pair::Has<QuickV0Cut_DCAbtwDau>::value;
+        default:
+            return QuickV0Preset_Lambda<Double_t>::Pair::Has<QuickV0Cut_DCAbtwDau>::value;
+    }
 }
 
 /*
- Loop over MC particles in a single event. Store the indices of the signal particles.
+ Loop over all MC particles in a single event. Store the indices of the signal particles.
+ Only executed when `fProcessFullMCStack` is set, i.e., when generated-level spectra are needed.
 */
 void AliAnalysisQuickTask::ProcessMCGen() {
 
     AliMCParticle* mcPart;
     Int_t pdg_mc;
 
-    for (Int_t mcIdx = 0; mcIdx < fMC->GetNumberOfTracks(); mcIdx++) {
+    Int_t nMCTracks = fMC->GetNumberOfTracks();
 
-        mcPart = (AliMCParticle*)fMC->GetTrack(mcIdx);
-        pdg_mc = mcPart->PdgCode();
+    for (Int_t mcIdx = 0; mcIdx < nMCTracks; mcIdx++) {
+
+        mcPart = static_cast<AliMCParticle*>(fMC->GetTrack(mcIdx));
 
-        if (pdg_mc != 2212) continue;
         if (!mcPart->IsPhysicalPrimary()) continue;
 
+        pdg_mc = mcPart->PdgCode();
+        if (pdg_mc != 2212) continue;
+
         getPdgCode_fromMcIdx[mcIdx] = pdg_mc;
     }
 }
 
+/*
+ Resolve, on demand, the MC particles referenced by the selected tracks, walking up their mother chains.
+ Particles already resolved in this event (e.g. shared mothers) are not visited twice.
+ Their PDG codes are kept apart from `getPdgCode_fromMcIdx`, which only holds the generated particles of interest from `ProcessMCGen()`.
+ - Uses: `mcIndicesOfSelectedTracks`
+ - Output: `getAncestorPdgCode_fromMcIdx`, `getMotherMcIdx_fromMcIdx`
+*/
+void AliAnalysisQuickTask::ResolveMCLabels() {
+
+    AliMCParticle* mcPart;
+    Int_t mcIdx;
+
+    Int_t nMCTracks = fMC->GetNumberOfTracks();
+
+    for (Int_t& mcIdxOfTrack : mcIndicesOfSelectedTracks) {
+
+        mcIdx = mcIdxOfTrack;
+
+        while (mcIdx >= 0 && mcIdx < nMCTracks && !getMotherMcIdx_fromMcIdx.count(mcIdx)) {
+
+            mcPart = static_cast<AliMCParticle*>(fMC->GetTrack(mcIdx));
+
+            getAncestorPdgCode_fromMcIdx[mcIdx] = mcPart->PdgCode();
+            getMotherMcIdx_fromMcIdx[mcIdx] = mcPart->GetMother();
+
+            mcIdx = mcPart->GetMother();
+        }
+    }
+}
+
 /*                   */
 /**  Reconstructed  **/
 /*** ============= ***/
@@ -236,57 +564,99 @@ void AliAnalysisQuickTask::ProcessMCGen() {
 void AliAnalysisQuickTask::ProcessTracks() {
 
     AliESDtrack* track;
+    Float_t nSigmaProton;
+    Float_t nSigmaPion;
 
     for (Int_t esdIdxTrack = 0; esdIdxTrack < fESD->GetNumberOfTracks(); esdIdxTrack++) {
 
         track = static_cast<AliESDtrack*>(fESD->GetTrack(esdIdxTrack));
 
+        fTrackCuts.CutFlow[kTrackStage_Tracks]++;
         if (!PassesTrackSelection(track)) continue;
 
-        /* Store tracks indices */
+        nSigmaProton = fPIDResponse->NumberOfSigmasTPC(track, AliPID::kProton);
+        nSigmaPion = fPIDResponse->NumberOfSigmasTPC(track, AliPID::kPion);
 
-        if (track->Charge() < 0 && TMath::Abs(fPIDResponse->NumberOfSigmasTPC(track, AliPID::kProton)) < 3.) {
-            esdIndicesOfAntiProtonTracks.push_back(esdIdxTrack);
-        }
+        /* Store tracks */
 
-        if (track->Charge() > 0 && TMath::Abs(fPIDResponse->NumberOfSigmasTPC(track, AliPID::kPion)) < 3.) {
-            esdIndicesOfPiPlusTracks.push_back(esdIdxTrack);
-        }
+        StoreDaughter(*track, esdIdxTrack, nSigmaProton, nSigmaPion, track->GetLabel());
 
         /* Fill histograms */
 
-        fHist_Tracks_NSigmaProton->Fill(fPIDResponse->NumberOfSigmasTPC(track, AliPID::kProton));
-        fHist_Tracks_NSigmaPion->Fill(fPIDResponse->NumberOfSigmasTPC(track, AliPID::kPion));
-        fHist_Tracks_Eta->Fill(track->Eta());
+        fHist_Tracks_NSigmaProton->Fill(nSigmaProton, fEventWeight);
+        fHist_Tracks_NSigmaPion->Fill(nSigmaPion, fEventWeight);
+        fHist_Tracks_Eta->Fill(track->Eta(), fEventWeight);
         PlotStatus(track);
     }  // end of loop over tracks
+
+    /* Flush the cut flow of this event */
+
+    for (Int_t stage = 0; stage < kNTrackCutStages; stage++) {
+        if (fTrackCuts.CutFlow[stage]) fHist_Tracks_CutFlow->Fill(stage, fTrackCuts.CutFlow[stage] * fEventWeight);
+        fTrackCuts.CutFlow[stage] = 0;
+    }
 }
 
 /*
- Determine if current AliESDtrack passes track selection,
- and fill the bookkeeping histograms to measure the effect of the cuts.
- - Input: `track`
- - Return: `kTRUE` if the candidate passes the cuts, `kFALSE` otherwise
+ Tag a selected track with the daughter species it's compatible with, and store its index, its KFParticles and its MC label.
+ Only the species needed by at least one V0 hypothesis are kept, and one KFParticle is created per kept species.
+ Shared by `ProcessTracks()` and `ReplaySkim()`, so both apply the same PID selection.
+ - Uses: `fSpeciesOfNegDaughters`, `fSpeciesOfPosDaughters`, `fDaughterMass`
+ - Input: `track`, `esdIdxTrack`, `nSigmaProton`, `nSigmaPion`, `mcLabel`
+ - Return: `kTRUE` if the track was stored as a daughter, `kFALSE` otherwise
 */
-Bool_t AliAnalysisQuickTask::PassesTrackSelection(AliESDtrack* track) {
+Bool_t AliAnalysisQuickTask::StoreDaughter(AliExternalTrackParam& track, Int_t esdIdxTrack, Float_t nSigmaProton, Float_t nSigmaPion,
+                                           Int_t mcLabel) {
 
-    // >> p
-    if (!track->GetInnerParam()) return kFALSE;
-    if (kMin_Track_P && track->GetInnerParam()->GetP() < kMin_Track_P) return kFALSE;
-    if (kMax_Track_P && track->GetInnerParam()->GetP() > kMax_Track_P) return kFALSE;
+    UChar_t species = 0;
+    if (TMath::Abs(nSigmaProton) < 3.) species |= 1 << kDaughterProton;
+    if (TMath::Abs(nSigmaPion) < 3.) species |= 1 << kDaughterPion;
 
-    // >> eta
-    if (kMax_Track_Eta && TMath::Abs(track->Eta()) > kMax_Track_Eta) return kFALSE;
+    Bool_t isNeg = track.Charge() < 0;
+    species &= isNeg ? fSpeciesOfNegDaughters : fSpeciesOfPosDaughters;
 
-    // >> TPC clusters
-    if (kMin_Track_NTPCClusters && track->GetTPCNcls() < kMin_Track_NTPCClusters) return kFALSE;
+    if (!species) return kFALSE;
 
-    // >> chi2 per TPC cluster
-    if (kMax_Track_Chi2PerNTPCClusters && track->GetTPCchi2() / (Double_t)track->GetTPCNcls() > kMax_Track_Chi2PerNTPCClusters) return kFALSE;
+    ArenaVector<Int_t>& esdIndicesOfTracks = isNeg ? esdIndicesOfNegTracks : esdIndicesOfPosTracks;
+    ArenaVector<UChar_t>& speciesOfTracks = isNeg ? speciesOfNegTracks : speciesOfPosTracks;
+    ArenaVector<KFParticle>& kfTracks = isNeg ? kfNegTracks : kfPosTracks;
+
+    esdIndicesOfTracks.push_back(esdIdxTrack);
+    speciesOfTracks.push_back(species);
+    for (Int_t iSpecies = 0; iSpecies < kNDaughterSpecies; iSpecies++) {
+        if (species & (1 << iSpecies)) {
+            kfTracks.push_back(CreateKFParticle(track, fDaughterMass[iSpecies], (Int_t)track.Charge()));
+        } else {
+            kfTracks.push_back(KFParticle());
+        }
+    }
+
+    mcIndicesOfSelectedTracks.push_back(TMath::Abs(mcLabel));
+
+    if (fWriteSkim) {
+        fSkim_X.push_back(track.GetX());
+        fSkim_Alpha.push_back(track.GetAlpha());
+        fSkim_Param.insert(fSkim_Param.end(), track.GetParameter(), track.GetParameter() + 5);
+        fSkim_Cov.insert(fSkim_Cov.end(), track.GetCovariance(), track.GetCovariance() + 15);
+        fSkim_NSigmaProton.push_back(nSigmaProton);
+        fSkim_NSigmaPion.push_back(nSigmaPion);
+        fSkim_Label.push_back(mcLabel);
+        fSkim_EsdIdx.push_back(esdIdxTrack);
+    }
 
     return kTRUE;
 }
 
+/*
+ Determine if current AliESDtrack passes track selection, through the cut kernel of the active preset,
+ which also counts the tracks surviving each cut.
+ - Input: `track`
+ - Return: `kTRUE` if the candidate passes the cuts, `kFALSE` otherwise
+*/
+Bool_t AliAnalysisQuickTask::PassesTrackSelection(AliESDtrack* track) {
+    return fTrackCutKernel(*track, fTrackCuts);
+}
+
 /*
  Plot the status of the track.
  - Input: `track`, `stage`, `esdPdgCode`
@@ -300,7 +670,7 @@ void AliAnalysisQuickTask::PlotStatus(AliESDtrack* track) {
                                       AliESDtrack::kMultSec, AliESDtrack::kEmbedded,   AliESDtrack::kITSpureSA,   AliESDtrack::kESDpid};
 
     for (Int_t i = 0; i < 20; i++) {
-        if ((track->GetStatus() & StatusCollection[i])) fHist_Tracks_Status->Fill(i);
+        if ((track->GetStatus() & StatusCollection[i])) fHist_Tracks_Status->Fill(i, fEventWeight);
     }
 }
 
@@ -309,136 +679,814 @@ void AliAnalysisQuickTask::PlotStatus(AliESDtrack* track) {
 /*** ==================== ***/
 
 /*
- Define V0 selection cuts.
- - Uses: `fSourceOfV0s`
+ Build the table of V0 decay hypotheses from `fV0HypothesesOption`, and the masks of daughter species they need.
+*/
+void AliAnalysisQuickTask::PrepareV0Hypotheses() {
+
+    fV0Hypotheses.clear();
+
+    TObjArray* tokens = fV0HypothesesOption.Tokenize(",");
+    for (Int_t i = 0; i < tokens->GetEntries(); i++) {
+        TString name = static_cast<TObjString*>(tokens->At(i))->GetString();
+        name = name.Strip(TString::kBoth);
+        if (name == "AntiLambda") {
+            AddV0Hypothesis(name, -3122, -2212, 211, 0.5, 1.5);
+        } else if (name == "Lambda") {
+            AddV0Hypothesis(name, 3122, -211, 2212, 0.5, 1.5);
+        } else if (name == "KaonZeroShort") {
+            AddV0Hypothesis(name, 310, -211, 211, 0.3, 0.7);
+        } else {
+            AliFatalF("!! Unknown V0 hypothesis %s !!", name.Data());
+        }
+    }
+    delete tokens;
+
+    if (fV0Hypotheses.size() > 8 * sizeof(UInt_t)) AliFatal("!! Too many V0 hypotheses !!");
+
+    fSpeciesOfNegDaughters = 0;
+    fSpeciesOfPosDaughters = 0;
+    for (QuickV0Hypothesis& hyp : fV0Hypotheses) {
+        fSpeciesOfNegDaughters |= 1 << hyp.SpeciesNeg;
+        fSpeciesOfPosDaughters |= 1 << hyp.SpeciesPos;
+    }
+
+    fDaughterMass[kDaughterProton] = fPDG.GetParticle(2212)->Mass();
+    fDaughterMass[kDaughterPion] = fPDG.GetParticle(211)->Mass();
+}
+
+/*
+ Append a V0 decay hypothesis to the table. Its cuts are set by `DefineV0Cuts()`, and its histograms by `PrepareOutputLists()`.
+ - Input: `name`, `pdgV0`, `pdgNeg`, `pdgPos`, `histMinMass`, `histMaxMass`
+*/
+void AliAnalysisQuickTask::AddV0Hypothesis(TString name, Int_t pdgV0, Int_t pdgNeg, Int_t pdgPos, Double_t histMinMass, Double_t histMaxMass) {
+
+    QuickV0Hypothesis hyp = {};
+
+    hyp.Name = name;
+    hyp.PdgV0 = pdgV0;
+    hyp.PdgNeg = pdgNeg;
+    hyp.PdgPos = pdgPos;
+    hyp.SpeciesNeg = GetDaughterSpecies(pdgNeg);
+    hyp.SpeciesPos = GetDaughterSpecies(pdgPos);
+    if (hyp.SpeciesNeg < 0 || hyp.SpeciesPos < 0) AliFatalF("!! V0 hypothesis %s has unsupported daughters !!", name.Data());
+    hyp.MassNeg = fPDG.GetParticle(pdgNeg)->Mass();
+    hyp.MassPos = fPDG.GetParticle(pdgPos)->Mass();
+    hyp.HistMinMass = histMinMass;
+    hyp.HistMaxMass = histMaxMass;
+
+    fV0Hypotheses.push_back(hyp);
+}
+
+/*
+ - Input: `pdgCode`
+ - Return: the `QuickDaughterSpecies` of a charged daughter, -1 if not supported
+*/
+Int_t AliAnalysisQuickTask::GetDaughterSpecies(Int_t pdgCode) {
+    if (TMath::Abs(pdgCode) == 2212) return kDaughterProton;
+    if (TMath::Abs(pdgCode) == 211) return kDaughterPion;
+    return -1;
+}
+
+/*
+ Define V0 selection cuts and pick the cut kernels, for each hypothesis.
  - Input: `cuts_option`
 */
 void AliAnalysisQuickTask::DefineV0Cuts(TString cuts_option) {
 
-    kMin_V0_Mass = 1.08;
-    kMax_V0_Mass = 1.16;
-    kMin_V0_Pt = 1.0;
-    kMax_V0_Eta = 0.9;
+    for (QuickV0Hypothesis& hyp : fV0Hypotheses) {
+
+        if (TMath::Abs(hyp.PdgV0) == 3122) {
+            hyp.kMin_V0_Mass = 1.08;
+            hyp.kMax_V0_Mass = 1.16;
+            hyp.kMin_V0_Pt = 1.0;
+            hyp.kMax_V0_Eta = 0.9;
+
+            hyp.kMin_V0_CPAwrtPV = 0.99;
+            hyp.kMax_V0_CPAwrtPV = 1.;
+            hyp.kMax_V0_DCAwrtPV = 1.;
+            hyp.kMax_V0_DCAbtwDau = 2.;
+            hyp.kMax_V0_DCAnegV0 = 2.;
+            hyp.kMax_V0_DCAposV0 = 2.;
+            hyp.kMax_V0_ArmPtOverAlpha = 0.2;
+            hyp.kMax_V0_Chi2ndf = 10.;
+        }
+
+        if (hyp.PdgV0 == 310) {
+            hyp.kMin_V0_Mass = 0.46;
+            hyp.kMax_V0_Mass = 0.54;
+            hyp.kMin_V0_Pt = 1.0;
+            hyp.kMax_V0_Eta = 0.9;
+
+            hyp.kMin_V0_CPAwrtPV = 0.99;
+            hyp.kMax_V0_CPAwrtPV = 1.;
+            hyp.kMax_V0_DCAwrtPV = 1.;
+            hyp.kMax_V0_DCAbtwDau = 2.;
+            hyp.kMax_V0_DCAnegV0 = 2.;
+            hyp.kMax_V0_DCAposV0 = 2.;
+            hyp.kMax_V0_ArmPtOverAlpha = 0.;  // not in the K0S preset
+            hyp.kMax_V0_Chi2ndf = 10.;
+        }
+
+        /* Pick the cut kernels */
 
-    kMin_V0_CPAwrtPV = 0.99;
-    kMax_V0_CPAwrtPV = 1.;
-    kMax_V0_DCAwrtPV = 1.;
-    kMax_V0_DCAbtwDau = 2.;
-    kMax_V0_DCAnegV0 = 2.;
-    kMax_V0_DCAposV0 = 2.;
-    kMax_V0_ArmPtOverAlpha = 0.2;
-    kMax_V0_Chi2ndf = 10.;
+        Int_t preset = hyp.PdgV0 == 310 ? kV0Preset_KaonZeroShort : kV0Preset_Lambda;
+        if (cuts_option.Contains("open")) preset = kV0Preset_Open;
+        GetV0CutKernels(preset, cuts_option.Contains("float"), hyp.PairKernel, hyp.KinematicKernel, hyp.TopologicalKernel);
+        hyp.NeedsDCAbtwDau = V0PresetNeedsDCAbtwDau(preset);
+    }
 }
 
 /*
- Find all V0s via Kalman Filter.
+ Find all V0s via Kalman Filter, for all hypotheses in a single pass over the pairs of daughters.
+ The DCA between daughters and the daughters' momenta at the PCA don't depend on the daughters' masses, so they're computed once per pair
+ and shared by all hypotheses that use that pair, and only when the first hypothesis that needs them gets there.
+ - Uses: `fV0Hypotheses`, `esdIndicesOfNegTracks`, `esdIndicesOfPosTracks`, `speciesOfNegTracks`, `speciesOfPosTracks`, `kfNegTracks`,
+ `kfPosTracks`
 */
 void AliAnalysisQuickTask::KalmanV0Finder() {
 
-    AliESDtrack* esdTrackNeg;
-    AliESDtrack* esdTrackPos;
+    /* Declare TLorentzVectors */
+
+    TLorentzVector lvTrackNeg;
+    TLorentzVector lvTrackPos;
+    TLorentzVector lvV0;
 
-    /* Define primary vertex as a KFVertex */
+    UInt_t nHypotheses = fV0Hypotheses.size();
+    UInt_t pairHypotheses;
+    Int_t firstHyp;
 
-    KFVertex kfPrimaryVertex = CreateKFVertex(*fPrimaryVertex);
+    Bool_t hasDCAbtwDau;
+    Bool_t isTransported;
+    Double_t momNeg[3], momPos[3];
 
-    /* Declare TLorentzVectors */
+    QuickV0CutInput cutInput = {nullptr, nullptr, nullptr, &lvV0, &lvTrackNeg, &lvTrackPos, 0., {0., 0., 0.}};
+    fPrimaryVertex->GetXYZ(cutInput.PV);
+
+    /* Prescale the pairs of large events */
+
+    Long64_t nPairs = (Long64_t)esdIndicesOfNegTracks.size() * (Long64_t)esdIndicesOfPosTracks.size();
+    fPairWeight = fPrescalePairs < 1. && nPairs > kPrescale_MinPairs ? 1. / fPrescalePairs : 1.;
+    Double_t weight = fEventWeight * fPairWeight;
+
+    /* Loop over all possible pairs of tracks -- the daughters' KFParticles were created once per track in `StoreDaughter()` */
+
+    for (size_t iNeg = 0; iNeg < esdIndicesOfNegTracks.size(); iNeg++) {
+        for (size_t iPos = 0; iPos < esdIndicesOfPosTracks.size(); iPos++) {
+
+            /* Sanity check */
+
+            if (esdIndicesOfNegTracks[iNeg] == esdIndicesOfPosTracks[iPos]) continue;
+
+            /* Find the hypotheses that use this pair */
+
+            pairHypotheses = 0;
+            firstHyp = -1;
+            for (UInt_t iHyp = 0; iHyp < nHypotheses; iHyp++) {
+                if ((speciesOfNegTracks[iNeg] & (1 << fV0Hypotheses[iHyp].SpeciesNeg)) &&
+                    (speciesOfPosTracks[iPos] & (1 << fV0Hypotheses[iHyp].SpeciesPos))) {
+                    pairHypotheses |= 1 << iHyp;
+                    if (firstHyp < 0) firstHyp = iHyp;
+                    fV0Hypotheses[iHyp].CutFlow[kV0Stage_Pairs]++;  // before the prescale, so all pairs are counted
+                }
+            }
+            if (!pairHypotheses) continue;
+
+            if (fPairWeight > 1. && !PassesPairPrescale(esdIndicesOfNegTracks[iNeg], esdIndicesOfPosTracks[iPos])) continue;
+
+            /* Shared pair geometry */
+
+            const KFParticle& kfAnyNeg = kfNegTracks[iNeg * kNDaughterSpecies + fV0Hypotheses[firstHyp].SpeciesNeg];
+            const KFParticle& kfAnyPos = kfPosTracks[iPos * kNDaughterSpecies + fV0Hypotheses[firstHyp].SpeciesPos];
+
+            hasDCAbtwDau = kFALSE;
+            isTransported = kFALSE;
+
+            for (UInt_t iHyp = firstHyp; iHyp < nHypotheses; iHyp++) {
+
+                if (!(pairHypotheses & (1 << iHyp))) continue;
+
+                QuickV0Hypothesis& hyp = fV0Hypotheses[iHyp];
+
+                /* DCA between daughters, once per pair */
+
+                if (hyp.NeedsDCAbtwDau && !hasDCAbtwDau) {
+                    cutInput.DCAbtwDau = kfAnyNeg.GetDistanceFromParticle(kfAnyPos);
+                    hasDCAbtwDau = kTRUE;
+                }
+
+                if (!hyp.PairKernel(cutInput, hyp)) continue;
+
+                /* Transport daughters, once per pair */
+
+                if (!isTransported) {
+                    KFParticle kfTransportedNeg = TransportKFParticle(kfAnyNeg, kfAnyPos, hyp.MassNeg, (Int_t)kfAnyNeg.GetQ());
+                    KFParticle kfTransportedPos = TransportKFParticle(kfAnyPos, kfAnyNeg, hyp.MassPos, (Int_t)kfAnyPos.GetQ());
+                    momNeg[0] = kfTransportedNeg.Px();
+                    momNeg[1] = kfTransportedNeg.Py();
+                    momNeg[2] = kfTransportedNeg.Pz();
+                    momPos[0] = kfTransportedPos.Px();
+                    momPos[1] = kfTransportedPos.Py();
+                    momPos[2] = kfTransportedPos.Pz();
+                    isTransported = kTRUE;
+                }
+
+                /* Reconstruct V0 */
+
+                lvTrackNeg.SetXYZM(momNeg[0], momNeg[1], momNeg[2], hyp.MassNeg);
+                lvTrackPos.SetXYZM(momPos[0], momPos[1], momPos[2], hyp.MassPos);
+                lvV0 = lvTrackNeg + lvTrackPos;
+
+                if (!hyp.KinematicKernel(cutInput, hyp)) continue;
+
+                /* Kalman Filter, with this hypothesis' daughters */
+
+                const KFParticle& kfDaughterNeg = kfNegTracks[iNeg * kNDaughterSpecies + hyp.SpeciesNeg];
+                const KFParticle& kfDaughterPos = kfPosTracks[iPos * kNDaughterSpecies + hyp.SpeciesPos];
+
+                KFParticleMother kfV0;
+                kfV0.AddDaughter(kfDaughterNeg);
+                kfV0.AddDaughter(kfDaughterPos);
+
+                kfV0.TransportToDecayVertex();
+
+                /* Apply cuts and fill hist */
+
+                cutInput.kfV0 = &kfV0;
+                cutInput.kfDaughterNeg = &kfDaughterNeg;
+                cutInput.kfDaughterPos = &kfDaughterPos;
+
+                if (!hyp.TopologicalKernel(cutInput, hyp)) continue;
+
+                hyp.Hist_Mass->Fill(lvV0.M(), weight);
+
+                if (!fSVHypotheses.empty()) {
+                    QuickV0Candidate candidate = {(Int_t)iHyp, esdIndicesOfNegTracks[iNeg], esdIndicesOfPosTracks[iPos], kfV0};
+                    acceptedV0s.push_back(candidate);
+                }
+            }  // end of loop over hypotheses
+        }      // end of loop over pos. tracks
+    }          // end of loop over neg. tracks
+
+    /* Flush the cut flow of this event */
+
+    for (QuickV0Hypothesis& hyp : fV0Hypotheses) {
+        for (Int_t stage = 0; stage < kNV0CutStages; stage++) {
+            // only the stages after the pair prescale are weighted for it
+            if (hyp.CutFlow[stage]) hyp.Hist_CutFlow->Fill(stage, hyp.CutFlow[stage] * (stage == kV0Stage_Pairs ? fEventWeight : weight));
+            hyp.CutFlow[stage] = 0;
+        }
+    }
+}
+
+/*                         */
+/**  V0s -- Event Mixing  **/
+/*** =================== ***/
+
+/*
+ Set up the mixed-event background of one V0 hypothesis: a copy of the hypothesis, with the same cut kernels and thresholds,
+ but its own cut flow and output histograms, and a pool of past events, binned by PV z and multiplicity.
+ Each bin is a ring buffer of `fMixingDepth` events with at most `kMixing_MaxTracksPerEvent` tracks each, allocated once,
+ so both the memory of the pool and the number of mixed pairs per event are bounded.
+ Note: the mixed-event spectrum is not normalized, that's left to the analysis of the output, e.g. in the sidebands.
+*/
+void AliAnalysisQuickTask::PrepareEventMixing() {
+
+    Int_t iHyp = FindV0Hypothesis(fMixingHypothesisOption);
+    if (iHyp < 0) AliFatalF("!! Event mixing requires the V0 hypothesis %s !!", fMixingHypothesisOption.Data());
+
+    fMixingHypothesis = fV0Hypotheses[iHyp];
+    fMixingHypothesis.Name += "_Mixed";
+    fMixingHypothesis.CutFlow.fill(0);
+
+    fMixingHypothesis.Hist_Mass = new TH1F(Form("%s_Mass", fMixingHypothesis.Name.Data()), "", 100, fMixingHypothesis.HistMinMass,
+                                           fMixingHypothesis.HistMaxMass);
+    fOutputListOfHists->Add(fMixingHypothesis.Hist_Mass);
+
+    fMixingHypothesis.Hist_CutFlow = new TH1F(Form("%s_CutFlow", fMixingHypothesis.Name.Data()), "", kNV0CutStages, 0., kNV0CutStages);
+    for (Int_t stage = 0; stage < kNV0CutStages; stage++) {
+        fMixingHypothesis.Hist_CutFlow->GetXaxis()->SetBinLabel(stage + 1, fV0Hypotheses[iHyp].Hist_CutFlow->GetXaxis()->GetBinLabel(stage + 1));
+    }
+    fOutputListOfHists->Add(fMixingHypothesis.Hist_CutFlow);
+
+    /* Binning and size of the pool */
+
+    kMixing_NBinsZ = 10;
+    kMixing_MaxAbsZ = 10.;
+    kMixing_MultEdges = {0, 50, 100, 200, 400, 800};  // the last bin is open
+    kMixing_MaxTracksPerEvent = 50;
+
+    Int_t nBins = kMixing_NBinsZ * (Int_t)kMixing_MultEdges.size();
+
+    fMixingPool.assign((size_t)nBins * fMixingDepth * kMixing_MaxTracksPerEvent, QuickMixingTrack());
+    fMixingPoolNTracks.assign((size_t)nBins * fMixingDepth, 0);
+    fMixingPoolNEvents.assign(nBins, 0);
+    fMixingPoolNextSlot.assign(nBins, 0);
+
+    AliInfoF("!! Event mixing of %s: %i bins x %i events x %i tracks, %.1f MB !!", fV0Hypotheses[iHyp].Name.Data(), nBins, fMixingDepth,
+             kMixing_MaxTracksPerEvent, fMixingPool.size() * sizeof(QuickMixingTrack) / 1e6);
+}
+
+/*
+ - Uses: `fPrimaryVertex`, `fESD`
+ - Return: the pool bin of the current event, -1 if it's outside of the binning
+*/
+Int_t AliAnalysisQuickTask::GetMixingBin() {
+
+    Double_t zPV = fPrimaryVertex->GetZ();
+    if (TMath::Abs(zPV) >= kMixing_MaxAbsZ) return -1;
+    Int_t binZ = (Int_t)((zPV + kMixing_MaxAbsZ) / (2. * kMixing_MaxAbsZ) * kMixing_NBinsZ);
+
+    Int_t nTracks = fESD->GetNumberOfTracks();
+    Int_t binMult = (Int_t)(std::upper_bound(kMixing_MultEdges.begin(), kMixing_MultEdges.end(), nTracks) - kMixing_MultEdges.begin()) - 1;
+
+    return binZ * (Int_t)kMixing_MultEdges.size() + binMult;
+}
+
+/*
+ Pair the negative daughters of the current event with the positive daughters of the pooled events of the same bin,
+ through the same DCA, kinematic and topological cuts as `KalmanV0Finder()`, then add the current event to the pool.
+ In high-multiplicity events, the daughters are sampled with a fixed stride, so at most
+ `fMixingDepth * kMixing_MaxTracksPerEvent^2` pairs are tried per event.
+ - Uses: `esdIndicesOfNegTracks`, `speciesOfNegTracks`, `kfNegTracks`, `fPrimaryVertex`
+*/
+void AliAnalysisQuickTask::EventMixing() {
+
+    Int_t bin = GetMixingBin();
+    if (bin < 0) return;
+
+    QuickV0Hypothesis& hyp = fMixingHypothesis;
 
     TLorentzVector lvTrackNeg;
     TLorentzVector lvTrackPos;
     TLorentzVector lvV0;
 
-    const Int_t pdgV0 = -3122;
-    const Int_t pdgTrackNeg = -2212;
-    const Int_t pdgTrackPos = 211;
+    QuickV0CutInput cutInput = {nullptr, nullptr, nullptr, &lvV0, &lvTrackNeg, &lvTrackPos, 0., {0., 0., 0.}};
+    fPrimaryVertex->GetXYZ(cutInput.PV);
 
-    /* Loop over all possible pairs of tracks */
+    Int_t nNeg = (Int_t)esdIndicesOfNegTracks.size();
+    Int_t strideNeg = TMath::Max(1, (nNeg + kMixing_MaxTracksPerEvent - 1) / kMixing_MaxTracksPerEvent);
 
-    for (Int_t& esdIdxNeg : esdIndicesOfAntiProtonTracks) {
-        for (Int_t& esdIdxPos : esdIndicesOfPiPlusTracks) {
+    Float_t param[6];
 
-            /* Sanity check */
+    /* Loop over the pooled events of this bin */
 
-            if (esdIdxNeg == esdIdxPos) continue;
+    for (Int_t iEvent = 0; iEvent < fMixingPoolNEvents[bin]; iEvent++) {
 
-            /* Get tracks */
+        Int_t slot = bin * fMixingDepth + iEvent;
+        const QuickMixingTrack* pooledTracks = &fMixingPool[(size_t)slot * kMixing_MaxTracksPerEvent];
 
-            esdTrackNeg = static_cast<AliESDtrack*>(fESD->GetTrack(esdIdxNeg));
-            esdTrackPos = static_cast<AliESDtrack*>(fESD->GetTrack(esdIdxPos));
+        for (Int_t iPooled = 0; iPooled < fMixingPoolNTracks[slot]; iPooled++) {
 
-            /* Kalman Filter */
+            /* Move the pooled track to the current primary vertex */
 
-            KFParticle kfDaughterNeg = CreateKFParticle(*esdTrackNeg, fPDG.GetParticle(pdgTrackNeg)->Mass(), (Int_t)esdTrackNeg->Charge());
-            KFParticle kfDaughterPos = CreateKFParticle(*esdTrackPos, fPDG.GetParticle(pdgTrackPos)->Mass(), (Int_t)esdTrackPos->Charge());
+            const QuickMixingTrack& pooled = pooledTracks[iPooled];
+            for (Int_t i = 0; i < 6; i++) param[i] = pooled.Param[i];
+            for (Int_t i = 0; i < 3; i++) param[i] += cutInput.PV[i];
 
-            KFParticleMother kfV0;
-            kfV0.AddDaughter(kfDaughterNeg);
-            kfV0.AddDaughter(kfDaughterPos);
+            KFParticle kfDaughterPos;
+            kfDaughterPos.Create(param, pooled.Cov, pooled.Charge, hyp.MassPos);
 
-            /* Transport V0 and daughters */
+            for (Int_t iNeg = 0; iNeg < nNeg; iNeg += strideNeg) {
 
-            kfV0.TransportToDecayVertex();
+                if (!(speciesOfNegTracks[iNeg] & (1 << hyp.SpeciesNeg))) continue;
 
-            KFParticle kfTransportedNeg = TransportKFParticle(kfDaughterNeg, kfDaughterPos, pdgTrackNeg, (Int_t)esdTrackNeg->Charge());
-            KFParticle kfTransportedPos = TransportKFParticle(kfDaughterPos, kfDaughterNeg, pdgTrackPos, (Int_t)esdTrackPos->Charge());
+                const KFParticle& kfDaughterNeg = kfNegTracks[iNeg * kNDaughterSpecies + hyp.SpeciesNeg];
 
-            /* Reconstruct V0 */
+                hyp.CutFlow[kV0Stage_Pairs]++;
 
-            lvTrackNeg.SetXYZM(kfTransportedNeg.Px(), kfTransportedNeg.Py(), kfTransportedNeg.Pz(), fPDG.GetParticle(pdgTrackNeg)->Mass());
-            lvTrackPos.SetXYZM(kfTransportedPos.Px(), kfTransportedPos.Py(), kfTransportedPos.Pz(), fPDG.GetParticle(pdgTrackPos)->Mass());
-            lvV0 = lvTrackNeg + lvTrackPos;
+                if (hyp.NeedsDCAbtwDau) cutInput.DCAbtwDau = kfDaughterNeg.GetDistanceFromParticle(kfDaughterPos);
 
-            /* Apply cuts and fill hist */
+                if (!hyp.PairKernel(cutInput, hyp)) continue;
 
-            if (!PassesV0Cuts(kfV0, kfDaughterNeg, kfDaughterPos, lvV0, lvTrackNeg, lvTrackPos)) continue;
+                /* Reconstruct V0 */
 
-            fHist_AntiLambda_Mass->Fill(lvV0.M());
-        }  // end of loop over pos. tracks
-    }      // end of loop over neg. tracks
+                KFParticle kfTransportedNeg = TransportKFParticle(kfDaughterNeg, kfDaughterPos, hyp.MassNeg, (Int_t)kfDaughterNeg.GetQ());
+                KFParticle kfTransportedPos = TransportKFParticle(kfDaughterPos, kfDaughterNeg, hyp.MassPos, (Int_t)kfDaughterPos.GetQ());
+
+                lvTrackNeg.SetXYZM(kfTransportedNeg.Px(), kfTransportedNeg.Py(), kfTransportedNeg.Pz(), hyp.MassNeg);
+                lvTrackPos.SetXYZM(kfTransportedPos.Px(), kfTransportedPos.Py(), kfTransportedPos.Pz(), hyp.MassPos);
+                lvV0 = lvTrackNeg + lvTrackPos;
+
+                if (!hyp.KinematicKernel(cutInput, hyp)) continue;
+
+                /* Kalman Filter */
+
+                KFParticleMother kfV0;
+                kfV0.AddDaughter(kfDaughterNeg);
+                kfV0.AddDaughter(kfDaughterPos);
+
+                kfV0.TransportToDecayVertex();
+
+                /* Apply cuts and fill hist */
+
+                cutInput.kfV0 = &kfV0;
+                cutInput.kfDaughterNeg = &kfDaughterNeg;
+                cutInput.kfDaughterPos = &kfDaughterPos;
+
+                if (!hyp.TopologicalKernel(cutInput, hyp)) continue;
+
+                hyp.Hist_Mass->Fill(lvV0.M(), fEventWeight);
+            }  // end of loop over neg. tracks
+        }      // end of loop over pooled tracks
+    }          // end of loop over pooled events
+
+    /* Flush the cut flow of this event */
+
+    for (Int_t stage = 0; stage < kNV0CutStages; stage++) {
+        if (hyp.CutFlow[stage]) hyp.Hist_CutFlow->Fill(stage, hyp.CutFlow[stage] * fEventWeight);
+        hyp.CutFlow[stage] = 0;
+    }
+
+    AddEventToMixingPool(bin);
 }
 
 /*
- Apply cuts to a V0 candidate.
+ Copy the positive daughters of the current event into the oldest slot of its pool bin.
+ - Input: `bin`
+ - Uses: `esdIndicesOfPosTracks`, `speciesOfPosTracks`, `kfPosTracks`, `fPrimaryVertex`
 */
-Bool_t AliAnalysisQuickTask::PassesV0Cuts(KFParticleMother kfV0, KFParticle kfDaughterNeg, KFParticle kfDaughterPos, TLorentzVector lvV0,
-                                          TLorentzVector lvTrackNeg, TLorentzVector lvTrackPos) {
+void AliAnalysisQuickTask::AddEventToMixingPool(Int_t bin) {
 
-    Double_t Mass = lvV0.M();
-    if (kMin_V0_Mass && Mass < kMin_V0_Mass) return kFALSE;
-    if (kMax_V0_Mass && Mass > kMax_V0_Mass) return kFALSE;
+    const QuickV0Hypothesis& hyp = fMixingHypothesis;
 
-    Double_t Pt = lvV0.Pt();
-    if (kMin_V0_Pt && Pt < kMin_V0_Pt) return kFALSE;
+    Int_t slot = bin * fMixingDepth + fMixingPoolNextSlot[bin];
+    QuickMixingTrack* pooledTracks = &fMixingPool[(size_t)slot * kMixing_MaxTracksPerEvent];
+    Int_t nPooled = 0;
 
-    Double_t Eta = TMath::Abs(lvV0.Eta());
-    if (kMax_V0_Eta && Eta > kMax_V0_Eta) return kFALSE;
+    Double_t PV[3];
+    fPrimaryVertex->GetXYZ(PV);
 
-    Double_t CPAwrtPV =
-        CosinePointingAngle(lvV0, kfV0.GetX(), kfV0.GetY(), kfV0.GetZ(), fPrimaryVertex->GetX(), fPrimaryVertex->GetY(), fPrimaryVertex->GetZ());
-    if (kMin_V0_CPAwrtPV && CPAwrtPV < kMin_V0_CPAwrtPV) return kFALSE;
-    if (kMax_V0_CPAwrtPV && CPAwrtPV > kMax_V0_CPAwrtPV) return kFALSE;
+    Int_t nPos = (Int_t)esdIndicesOfPosTracks.size();
+    Int_t stridePos = TMath::Max(1, (nPos + kMixing_MaxTracksPerEvent - 1) / kMixing_MaxTracksPerEvent);
 
-    Double_t DCAwrtPV = LinePointDCA(lvV0.Px(), lvV0.Py(), lvV0.Pz(), kfV0.GetX(), kfV0.GetY(), kfV0.GetZ(), fPrimaryVertex->GetX(),
-                                     fPrimaryVertex->GetY(), fPrimaryVertex->GetZ());
-    if (kMax_V0_DCAwrtPV && DCAwrtPV > kMax_V0_DCAwrtPV) return kFALSE;
+    for (Int_t iPos = 0; iPos < nPos && nPooled < kMixing_MaxTracksPerEvent; iPos += stridePos) {
 
-    Double_t DCAbtwDau = TMath::Abs(kfDaughterNeg.GetDistanceFromParticle(kfDaughterPos));
-    if (kMax_V0_DCAbtwDau && DCAbtwDau > kMax_V0_DCAbtwDau) return kFALSE;
+        if (!(speciesOfPosTracks[iPos] & (1 << hyp.SpeciesPos))) continue;
 
-    Double_t DCAnegV0 = TMath::Abs(kfDaughterNeg.GetDistanceFromVertex(kfV0));
-    if (kMax_V0_DCAnegV0 && DCAnegV0 > kMax_V0_DCAnegV0) return kFALSE;
+        const KFParticle& kfTrack = kfPosTracks[iPos * kNDaughterSpecies + hyp.SpeciesPos];
+        QuickMixingTrack& pooled = pooledTracks[nPooled++];
 
-    Double_t DCAposV0 = TMath::Abs(kfDaughterPos.GetDistanceFromVertex(kfV0));
-    if (kMax_V0_DCAposV0 && DCAposV0 > kMax_V0_DCAposV0) return kFALSE;
+        for (Int_t i = 0; i < 6; i++) pooled.Param[i] = kfTrack.GetParameter(i);
+        for (Int_t i = 0; i < 3; i++) pooled.Param[i] -= PV[i];
+        for (Int_t i = 0; i < 21; i++) pooled.Cov[i] = kfTrack.GetCovariance(i);
+        pooled.Charge = (Int_t)kfTrack.GetQ();
+    }
 
-    Double_t ArmPt = ArmenterosQt(lvV0.Px(), lvV0.Py(), lvV0.Pz(), lvTrackNeg.Px(), lvTrackNeg.Py(), lvTrackNeg.Pz());
-    Double_t ArmAlpha = ArmenterosAlpha(lvV0.Px(), lvV0.Py(), lvV0.Pz(), lvTrackNeg.Px(), lvTrackNeg.Py(), lvTrackNeg.Pz(), lvTrackPos.Px(),
-                                        lvTrackPos.Py(), lvTrackPos.Pz());
-    Double_t ArmPtOverAlpha = TMath::Abs(ArmPt / ArmAlpha);
-    if (kMax_V0_ArmPtOverAlpha && ArmPtOverAlpha > kMax_V0_ArmPtOverAlpha) return kFALSE;
+    // events without daughters don't take a slot
+    if (!nPooled) return;
 
-    Double_t Chi2ndf = (Double_t)kfV0.GetChi2() / (Double_t)kfV0.GetNDF();
-    if (kMax_V0_Chi2ndf && Chi2ndf > kMax_V0_Chi2ndf) return kFALSE;
+    fMixingPoolNTracks[slot] = nPooled;
+    fMixingPoolNextSlot[bin] = (fMixingPoolNextSlot[bin] + 1) % fMixingDepth;
+    fMixingPoolNEvents[bin] = TMath::Min(fMixingPoolNEvents[bin] + 1, fMixingDepth);
+}
+
+/*                                              */
+/**  Secondary Vertices -- V0+V0 and V0+Track  **/
+/*** ======================================== ***/
+
+/*
+ Build the table of secondary-vertex hypotheses from `fSVHypothesesOption`.
+ Must be called after `PrepareV0Hypotheses()`, as it refers to the V0 hypotheses by name.
+*/
+void AliAnalysisQuickTask::PrepareSVHypotheses() {
+
+    fSVHypotheses.clear();
+
+    TObjArray* tokens = fSVHypothesesOption.Tokenize(",");
+    for (Int_t i = 0; i < tokens->GetEntries(); i++) {
+        TString name = static_cast<TObjString*>(tokens->At(i))->GetString();
+        name = name.Strip(TString::kBoth);
+        if (name == "AntiSexaquarkA") {
+            // anti-sexaquark + neutron -> anti-lambda + K0S
+            AddSVHypothesis(name, "AntiLambda", "KaonZeroShort", 0, 1.5, 4.5);
+        } else if (name == "AntiXiPlus") {
+            // anti-xi+ -> anti-lambda + pi+
+            AddSVHypothesis(name, "AntiLambda", "", 211, 1.2, 1.5);
+        } else {
+            AliFatalF("!! Unknown secondary-vertex hypothesis %s !!", name.Data());
+        }
+    }
+    delete tokens;
+}
+
+/*
+ Append a secondary-vertex hypothesis to the table. Its cuts are set by `DefineSVCuts()`, and its histograms by `PrepareOutputLists()`.
+ - Input: `name`, `nameFirstV0`, `nameSecondV0` (empty if the second daughter is a track), `pdgSecondTrack`, `histMinMass`, `histMaxMass`
+*/
+void AliAnalysisQuickTask::AddSVHypothesis(TString name, TString nameFirstV0, TString nameSecondV0, Int_t pdgSecondTrack, Double_t histMinMass,
+                                           Double_t histMaxMass) {
+
+    QuickSVHypothesis hyp = {};
+
+    hyp.Name = name;
+
+    hyp.FirstV0 = FindV0Hypothesis(nameFirstV0);
+    if (hyp.FirstV0 < 0) AliFatalF("!! %s requires the V0 hypothesis %s !!", name.Data(), nameFirstV0.Data());
+
+    if (nameSecondV0 != "") {
+        hyp.SecondV0 = FindV0Hypothesis(nameSecondV0);
+        if (hyp.SecondV0 < 0) AliFatalF("!! %s requires the V0 hypothesis %s !!", name.Data(), nameSecondV0.Data());
+    } else {
+        hyp.SecondV0 = -1;
+        hyp.TrackCharge = pdgSecondTrack > 0 ? 1 : -1;  // only valid for protons and pions
+        hyp.TrackSpecies = GetDaughterSpecies(pdgSecondTrack);
+        if (hyp.TrackSpecies < 0) AliFatalF("!! %s has an unsupported track daughter !!", name.Data());
+        // make sure the tracks of this species are kept
+        if (hyp.TrackCharge < 0) fSpeciesOfNegDaughters |= 1 << hyp.TrackSpecies;
+        if (hyp.TrackCharge > 0) fSpeciesOfPosDaughters |= 1 << hyp.TrackSpecies;
+    }
+
+    hyp.HistMinMass = histMinMass;
+    hyp.HistMaxMass = histMaxMass;
+
+    fSVHypotheses.push_back(hyp);
+}
+
+/*
+ - Input: `name`
+ - Return: index of the V0 hypothesis called `name`, -1 if not found
+*/
+Int_t AliAnalysisQuickTask::FindV0Hypothesis(TString name) {
+    for (size_t iHyp = 0; iHyp < fV0Hypotheses.size(); iHyp++) {
+        if (fV0Hypotheses[iHyp].Name == name) return (Int_t)iHyp;
+    }
+    return -1;
+}
+
+/*
+ Define secondary-vertex selection cuts, for each hypothesis, and the granularity of the spatial index.
+ Every track of the event passes close to the primary vertex, so the index prunes more combinations when the region around it is left out.
+ It's only left out for the hypotheses that cut on `kMin_SV_DistanceFromPV` anyway, with the same radius, so the index never drops
+ a combination that the cut on the fitted vertex would keep.
+ - Input: `cuts_option`
+*/
+void AliAnalysisQuickTask::DefineSVCuts(TString cuts_option) {
+
+    kGrid_CellSize = 2.;
+    kGrid_SegmentLength = 60.;
+
+    for (QuickSVHypothesis& hyp : fSVHypotheses) {
+
+        if (hyp.Name == "AntiSexaquarkA") {
+            hyp.kMin_SV_Mass = 0.;
+            hyp.kMax_SV_Mass = 0.;
+            hyp.kMin_SV_Pt = 0.;
+            hyp.kMin_SV_CPAwrtPV = 0.99;
+            hyp.kMax_SV_DCAwrtPV = 2.;
+            hyp.kMax_SV_DCAbtwDau = 2.;
+            hyp.kMax_SV_Chi2ndf = 10.;
+            hyp.kMin_SV_DistanceFromPV = 2.5;  // the reactions happen in the material, from the beam pipe outwards, on the fitted vertex too
+        }
+
+        if (hyp.Name == "AntiXiPlus") {
+            hyp.kMin_SV_Mass = 1.28;
+            hyp.kMax_SV_Mass = 1.36;
+            hyp.kMin_SV_Pt = 0.5;
+            hyp.kMin_SV_CPAwrtPV = 0.99;
+            hyp.kMax_SV_DCAwrtPV = 1.;
+            hyp.kMax_SV_DCAbtwDau = 2.;
+            hyp.kMax_SV_Chi2ndf = 10.;
+            hyp.kMin_SV_DistanceFromPV = 0.;  // disabled, the Xi decays close to the primary vertex
+        }
+    }
+}
+
+/*
+ Linearized trajectory of a neutral V0 before its decay: a segment that ends at its decay vertex.
+ It's cut short of the sphere of radius `minDistanceFromPV` around the primary vertex, where every track of the event passes.
+ If the V0 decays inside the sphere, the segment starts where its trajectory, going backwards, leaves the sphere.
+ - Input: `kfParticle`, `minDistanceFromPV`
+ - Output: `start`, `end`
+ - Return: kFALSE if the whole segment lies inside that sphere
+*/
+Bool_t AliAnalysisQuickTask::GetUpstreamSegment(const KFParticle& kfParticle, Float_t minDistanceFromPV, Double_t start[3], Double_t end[3]) {
+
+    Double_t P = TMath::Max((Double_t)kfParticle.GetP(), 1e-6);
+    Double_t direction[3] = {-kfParticle.GetPx() / P, -kfParticle.GetPy() / P, -kfParticle.GetPz() / P};
+
+    end[0] = kfParticle.GetX();
+    end[1] = kfParticle.GetY();
+    end[2] = kfParticle.GetZ();
+
+    // intersections with the sphere: end + t * direction, with t^2 + 2 * b * t + c = 0
+    Double_t relPos[3] = {end[0] - fPrimaryVertex->GetX(), end[1] - fPrimaryVertex->GetY(), end[2] - fPrimaryVertex->GetZ()};
+    Double_t b = relPos[0] * direction[0] + relPos[1] * direction[1] + relPos[2] * direction[2];
+    Double_t c = relPos[0] * relPos[0] + relPos[1] * relPos[1] + relPos[2] * relPos[2] - minDistanceFromPV * minDistanceFromPV;
+
+    Double_t offset = 0.;
+    Double_t length = kGrid_SegmentLength;
+    if (c <= 0.) {
+        offset = -b + TMath::Sqrt(b * b - c);  // decays inside the sphere: only keep the part of the trajectory outside of it
+        if (offset >= length) return kFALSE;
+    } else if (b < 0. && b * b - c > 0.) {
+        length = TMath::Min(length, -b - TMath::Sqrt(b * b - c));  // stop where it enters the sphere, if it goes towards it
+    }
+
+    for (Int_t i = 0; i < 3; i++) {
+        start[i] = end[i] + length * direction[i];
+        end[i] += offset * direction[i];
+    }
+    return kTRUE;
+}
+
+/*
+ Linearized trajectory of a track: a segment that starts at its reference point, close to the primary vertex,
+ or where it leaves the sphere of radius `minDistanceFromPV` around the primary vertex.
+ - Input: `kfParticle`, `minDistanceFromPV`
+ - Output: `start`, `end`
+ - Return: kFALSE if the whole segment lies inside that sphere
+*/
+Bool_t AliAnalysisQuickTask::GetDownstreamSegment(const KFParticle& kfParticle, Float_t minDistanceFromPV, Double_t start[3], Double_t end[3]) {
+
+    Double_t P = TMath::Max((Double_t)kfParticle.GetP(), 1e-6);
+    Double_t direction[3] = {kfParticle.GetPx() / P, kfParticle.GetPy() / P, kfParticle.GetPz() / P};
+    Double_t refPoint[3] = {kfParticle.GetX(), kfParticle.GetY(), kfParticle.GetZ()};
+
+    // intersections with the sphere: refPoint + t * direction, with t^2 + 2 * b * t + c = 0
+    Double_t relPos[3] = {refPoint[0] - fPrimaryVertex->GetX(), refPoint[1] - fPrimaryVertex->GetY(), refPoint[2] - fPrimaryVertex->GetZ()};
+    Double_t b = relPos[0] * direction[0] + relPos[1] * direction[1] + relPos[2] * direction[2];
+    Double_t c = relPos[0] * relPos[0] + relPos[1] * relPos[1] + relPos[2] * relPos[2] - minDistanceFromPV * minDistanceFromPV;
+
+    Double_t offset = 0.;
+    if (b * b - c > 0.) offset = TMath::Max(-b + TMath::Sqrt(b * b - c), 0.);  // start where it leaves the sphere
+    if (offset >= kGrid_SegmentLength) return kFALSE;
+
+    for (Int_t i = 0; i < 3; i++) {
+        start[i] = refPoint[i] + offset * direction[i];
+        end[i] = refPoint[i] + kGrid_SegmentLength * direction[i];
+    }
+    return kTRUE;
+}
+
+/*
+ Combine the accepted V0s with further V0s or selected daughter tracks, for all secondary-vertex hypotheses.
+ The second daughters are indexed in a per-event spatial grid, so only the combinations whose linearized trajectories pass close
+ to each other are fitted with the Kalman Filter, instead of all of them.
+ - Uses: `fSVHypotheses`, `acceptedV0s`, `svGrid`, and the daughter pools
+*/
+void AliAnalysisQuickTask::SecondaryVertexFinder() {
+
+    QuickTaskArenaAllocator<Int_t> allocator(&fArena);
+
+    ArenaVector<Int_t> firstObjects(allocator);
+    ArenaVector<Int_t> secondObjects(allocator);
+    ArenaVector<Int_t> lastVisitedBy(allocator);
+    ArenaVector<Int_t> pairedObjects(allocator);
+
+    Double_t start[3], end[3];
+    Double_t DCAbtwDau;
+    Int_t esdIdxTrack;
+    Bool_t sharesDaughter;
+    Bool_t hasSegment;
+
+    for (QuickSVHypothesis& hyp : fSVHypotheses) {
+
+        Bool_t secondIsV0 = hyp.SecondV0 >= 0;
+        // each V0 daughter survived the pair prescale on its own
+        hyp.Weight = fEventWeight * fPairWeight * (secondIsV0 ? fPairWeight : 1.);
+        ArenaVector<Int_t>& esdIndicesOfTracks = hyp.TrackCharge < 0 ? esdIndicesOfNegTracks : esdIndicesOfPosTracks;
+        ArenaVector<UChar_t>& speciesOfTracks = hyp.TrackCharge < 0 ? speciesOfNegTracks : speciesOfPosTracks;
+        ArenaVector<KFParticle>& kfTracks = hyp.TrackCharge < 0 ? kfNegTracks : kfPosTracks;
+
+        /* Collect the candidates of each side */
+
+        firstObjects.clear();
+        secondObjects.clear();
+
+        for (size_t iV0 = 0; iV0 < acceptedV0s.size(); iV0++) {
+            if (acceptedV0s[iV0].Hypothesis == hyp.FirstV0) firstObjects.push_back(iV0);
+            if (secondIsV0 && acceptedV0s[iV0].Hypothesis == hyp.SecondV0) secondObjects.push_back(iV0);
+        }
+
+        if (!secondIsV0) {
+            for (size_t iTrack = 0; iTrack < esdIndicesOfTracks.size(); iTrack++) {
+                if (speciesOfTracks[iTrack] & (1 << hyp.TrackSpecies)) secondObjects.push_back(iTrack);
+            }
+        }
+
+        hyp.CutFlow[kSVStage_AllPairs] += (Long64_t)firstObjects.size() * (Long64_t)secondObjects.size();
+        if (firstObjects.empty() || secondObjects.empty()) continue;
+
+        /* Index the second daughters */
+
+        svGrid.Clear(&fArena, kGrid_CellSize);
+
+        for (size_t iSecond = 0; iSecond < secondObjects.size(); iSecond++) {
+            if (secondIsV0) {
+                hasSegment = GetUpstreamSegment(acceptedV0s[secondObjects[iSecond]].KF, hyp.kMin_SV_DistanceFromPV, start, end);
+            } else {
+                hasSegment =
+                    GetDownstreamSegment(kfTracks[secondObjects[iSecond] * kNDaughterSpecies + hyp.TrackSpecies], hyp.kMin_SV_DistanceFromPV, start, end);
+            }
+            if (hasSegment) svGrid.Insert(iSecond, start, end);
+        }
+
+        lastVisitedBy.assign(secondObjects.size(), -1);
+
+        /* Loop over the first daughters, and over the second daughters found around them */
+
+        for (size_t iFirst = 0; iFirst < firstObjects.size(); iFirst++) {
+
+            const QuickV0Candidate& first = acceptedV0s[firstObjects[iFirst]];
+
+            if (!GetUpstreamSegment(first.KF, hyp.kMin_SV_DistanceFromPV, start, end)) continue;
+
+            pairedObjects.clear();
+            svGrid.Query(start, end, [&](Int_t iSecond) {
+                if (lastVisitedBy[iSecond] == (Int_t)iFirst) return;
+                lastVisitedBy[iSecond] = iFirst;
+                pairedObjects.push_back(iSecond);
+            });
+
+            for (Int_t& iSecond : pairedObjects) {
+
+                hyp.CutFlow[kSVStage_GridPairs]++;
+
+                /* Reject combinations that share a track */
+
+                if (secondIsV0) {
+                    const QuickV0Candidate& second = acceptedV0s[secondObjects[iSecond]];
+                    sharesDaughter = first.EsdIdxNeg == second.EsdIdxNeg || first.EsdIdxNeg == second.EsdIdxPos ||
+                                     first.EsdIdxPos == second.EsdIdxNeg || first.EsdIdxPos == second.EsdIdxPos;
+                } else {
+                    esdIdxTrack = esdIndicesOfTracks[secondObjects[iSecond]];
+                    sharesDaughter = first.EsdIdxNeg == esdIdxTrack || first.EsdIdxPos == esdIdxTrack;
+                }
+                if (sharesDaughter) continue;
+                hyp.CutFlow[kSVStage_SharedDau]++;
+
+                const KFParticle& kfSecond =
+                    secondIsV0 ? acceptedV0s[secondObjects[iSecond]].KF : kfTracks[secondObjects[iSecond] * kNDaughterSpecies + hyp.TrackSpecies];
+
+                if (hyp.kMax_SV_DCAbtwDau) {
+                    DCAbtwDau = TMath::Abs(first.KF.GetDistanceFromParticle(kfSecond));
+                    if (DCAbtwDau > hyp.kMax_SV_DCAbtwDau) continue;
+                }
+                hyp.CutFlow[kSVStage_DCAbtwDau]++;
+
+                /* Kalman Filter */
+
+                KFParticleMother kfSV;
+                kfSV.AddDaughter(first.KF);
+                kfSV.AddDaughter(kfSecond);
+
+                kfSV.TransportToDecayVertex();
+
+                /* Apply cuts and fill hist */
+
+                if (!PassesSVCuts(hyp, kfSV)) continue;
+
+                hyp.Hist_Mass->Fill(kfSV.GetMass(), hyp.Weight);
+            }  // end of loop over second daughters
+        }      // end of loop over first daughters
+    }          // end of loop over hypotheses
+
+    /* Flush the cut flow of this event */
+
+    for (QuickSVHypothesis& hyp : fSVHypotheses) {
+        for (Int_t stage = 0; stage < kNSVCutStages; stage++) {
+            if (hyp.CutFlow[stage]) hyp.Hist_CutFlow->Fill(stage, hyp.CutFlow[stage] * hyp.Weight);
+            hyp.CutFlow[stage] = 0;
+        }
+    }
+}
+
+/*
+ Apply cuts to a fitted secondary-vertex candidate.
+ Note: the DCA between daughters is applied beforehand in `SecondaryVertexFinder()`, to save the fit.
+*/
+Bool_t AliAnalysisQuickTask::PassesSVCuts(QuickSVHypothesis& hyp, const KFParticleMother& kfSV) {
+
+    Double_t DistanceFromPV = TMath::Sqrt((kfSV.GetX() - fPrimaryVertex->GetX()) * (kfSV.GetX() - fPrimaryVertex->GetX()) +
+                                          (kfSV.GetY() - fPrimaryVertex->GetY()) * (kfSV.GetY() - fPrimaryVertex->GetY()) +
+                                          (kfSV.GetZ() - fPrimaryVertex->GetZ()) * (kfSV.GetZ() - fPrimaryVertex->GetZ()));
+    if (hyp.kMin_SV_DistanceFromPV && DistanceFromPV < hyp.kMin_SV_DistanceFromPV) return kFALSE;
+    hyp.CutFlow[kSVStage_DistanceFromPV]++;
+
+    Double_t Mass = kfSV.GetMass();
+    if (hyp.kMin_SV_Mass && Mass < hyp.kMin_SV_Mass) return kFALSE;
+    if (hyp.kMax_SV_Mass && Mass > hyp.kMax_SV_Mass) return kFALSE;
+    hyp.CutFlow[kSVStage_Mass]++;
+
+    Double_t Pt = kfSV.GetPt();
+    if (hyp.kMin_SV_Pt && Pt < hyp.kMin_SV_Pt) return kFALSE;
+    hyp.CutFlow[kSVStage_Pt]++;
+
+    TLorentzVector lvSV(kfSV.GetPx(), kfSV.GetPy(), kfSV.GetPz(), kfSV.GetE());
+
+    Double_t CPAwrtPV =
+        CosinePointingAngle(lvSV, kfSV.GetX(), kfSV.GetY(), kfSV.GetZ(), fPrimaryVertex->GetX(), fPrimaryVertex->GetY(), fPrimaryVertex->GetZ());
+    if (hyp.kMin_SV_CPAwrtPV && CPAwrtPV < hyp.kMin_SV_CPAwrtPV) return kFALSE;
+    hyp.CutFlow[kSVStage_CPAwrtPV]++;
+
+    Double_t DCAwrtPV = LinePointDCA(lvSV.Px(), lvSV.Py(), lvSV.Pz(), kfSV.GetX(), kfSV.GetY(), kfSV.GetZ(), fPrimaryVertex->GetX(),
+                                     fPrimaryVertex->GetY(), fPrimaryVertex->GetZ());
+    if (hyp.kMax_SV_DCAwrtPV && DCAwrtPV > hyp.kMax_SV_DCAwrtPV) return kFALSE;
+    hyp.CutFlow[kSVStage_DCAwrtPV]++;
+
+    Double_t Chi2ndf = (Double_t)kfSV.GetChi2() / (Double_t)kfSV.GetNDF();
+    if (hyp.kMax_SV_Chi2ndf && Chi2ndf > hyp.kMax_SV_Chi2ndf) return kFALSE;
+    hyp.CutFlow[kSVStage_Chi2ndf]++;
 
     return kTRUE;
 }
@@ -580,11 +1628,10 @@ KFVertex AliAnalysisQuickTask::CreateKFVertex(const AliVVertex& vertex) {
 
 /*
  Transport a KFParticle to the point of closest approach w.r.t. another KFParticle.
- - Uses: `fPDG`
- - Input: `kfThis`, `kfOther`, `pdgThis`, `chargeThis`
+ - Input: `kfThis`, `kfOther`, `massThis`, `chargeThis`
  - Return: `kfTransported`
 */
-KFParticle AliAnalysisQuickTask::TransportKFParticle(KFParticle kfThis, KFParticle kfOther, Int_t pdgThis, Int_t chargeThis) {
+KFParticle AliAnalysisQuickTask::TransportKFParticle(const KFParticle& kfThis, const KFParticle& kfOther, Double_t massThis, Int_t chargeThis) {
 
     float dS[2];
     float dsdr[4][6];
@@ -593,7 +1640,7 @@ KFParticle AliAnalysisQuickTask::TransportKFParticle(KFParticle kfThis, KFPartic
     float mP[8], mC[36];
     kfThis.Transport(dS[0], dsdr[0], mP, mC);
 
-    float mM = fPDG.GetParticle(pdgThis)->Mass();
+    float mM = massThis;
     float mQ = chargeThis;  // only valid for charged particles with Q = +/- 1
 
     KFParticle kfTransported;
@@ -716,5 +1763,497 @@ Bool_t AliAnalysisQuickTask::LoadLogsIntoTree() {
     AliInfoF("!! Closing file %s ... !!", new_path.Data());
     SimLog.close();
 
+    // the branches point at the locals of this function
+    fLogTree->ResetBranchAddresses();
+
     return kTRUE;
 }
+
+/*                      */
+/**  Per-Event Memory  **/
+/*** ================ ***/
+
+/*
+ Release all transient per-event containers and rewind the arena that backs them.
+ The containers are re-bound to the arena, so this is also used to set them up in the constructors.
+*/
+void AliAnalysisQuickTask::ClearContainers() {
+
+    QuickTaskArenaAllocator<Int_t> allocator(&fArena);
+
+    getPdgCode_fromMcIdx = ArenaMap(allocator);
+    getAncestorPdgCode_fromMcIdx = ArenaMap(allocator);
+    getMotherMcIdx_fromMcIdx = ArenaMap(allocator);
+    mcIndicesOfSelectedTracks = ArenaVector<Int_t>(allocator);
+    esdIndicesOfNegTracks = ArenaVector<Int_t>(allocator);
+    esdIndicesOfPosTracks = ArenaVector<Int_t>(allocator);
+    speciesOfNegTracks = ArenaVector<UChar_t>(allocator);
+    speciesOfPosTracks = ArenaVector<UChar_t>(allocator);
+    kfNegTracks = ArenaVector<KFParticle>(allocator);
+    kfPosTracks = ArenaVector<KFParticle>(allocator);
+    acceptedV0s = ArenaVector<QuickV0Candidate>(allocator);
+    svGrid.Clear(&fArena, kGrid_CellSize);
+
+    fArena.Reset();
+}
+
+/*                             */
+/**  Skim of Daughter Tracks  **/
+/*** ======================= ***/
+
+/*
+ Enable or disable the skim of the selected daughter tracks.
+ When enabled, the task gets a third output slot, which must be connected to a TTree container (see `AddTask_QuickTask.C`).
+*/
+void AliAnalysisQuickTask::SetWriteSkim(Bool_t writeSkim) {
+    fWriteSkim = writeSkim;
+    if (fWriteSkim) DefineOutput(3, TTree::Class());  // fSkimTree
+}
+
+/*
+ Create the skim tree, attached to the file of output slot 3.
+ It holds one entry per event, with everything `KalmanV0Finder()` needs from the selected daughter tracks.
+*/
+void AliAnalysisQuickTask::PrepareSkimTree() {
+
+    OpenFile(3);
+
+    fSkimTree = new TTree("Skim", "Selected V0 daughter tracks");
+
+    // make sure the buffers have a valid address when creating the branches
+    fSkim_X.reserve(1024);
+    fSkim_Alpha.reserve(1024);
+    fSkim_Param.reserve(5 * 1024);
+    fSkim_Cov.reserve(15 * 1024);
+    fSkim_NSigmaProton.reserve(1024);
+    fSkim_NSigmaPion.reserve(1024);
+    fSkim_Label.reserve(1024);
+    fSkim_EsdIdx.reserve(1024);
+
+    fSkimTree->Branch("RunNumber", &fSkim_RunNumber, "RunNumber/I");
+    fSkimTree->Branch("EventNumber", &fSkim_EventNumber, "EventNumber/I");
+    fSkimTree->Branch("MagneticField", &fSkim_MagneticField, "MagneticField/D");
+    fSkimTree->Branch("PV", fSkim_PV, "PV[3]/D");
+    fSkimTree->Branch("PVCov", fSkim_PVCov, "PVCov[6]/D");
+    fSkimTree->Branch("N", &fSkim_N, "N/I");
+    fSkimTree->Branch("X", fSkim_X.data(), "X[N]/D");
+    fSkimTree->Branch("Alpha", fSkim_Alpha.data(), "Alpha[N]/D");
+    fSkimTree->Branch("Param", fSkim_Param.data(), "Param[N][5]/D");
+    fSkimTree->Branch("Cov", fSkim_Cov.data(), "Cov[N][15]/D");
+    fSkimTree->Branch("NSigmaProton", fSkim_NSigmaProton.data(), "NSigmaProton[N]/F");
+    fSkimTree->Branch("NSigmaPion", fSkim_NSigmaPion.data(), "NSigmaPion[N]/F");
+    fSkimTree->Branch("Label", fSkim_Label.data(), "Label[N]/I");
+    fSkimTree->Branch("EsdIdx", fSkim_EsdIdx.data(), "EsdIdx[N]/I");
+}
+
+/*
+ Point the branches of a skim tree to the skim buffers. Used both when writing and when replaying.
+ - Input: `skimTree`
+*/
+void AliAnalysisQuickTask::SetSkimBranchAddresses(TTree* skimTree) {
+    skimTree->SetBranchAddress("RunNumber", &fSkim_RunNumber);
+    skimTree->SetBranchAddress("EventNumber", &fSkim_EventNumber);
+    skimTree->SetBranchAddress("MagneticField", &fSkim_MagneticField);
+    skimTree->SetBranchAddress("PV", fSkim_PV);
+    skimTree->SetBranchAddress("PVCov", fSkim_PVCov);
+    skimTree->SetBranchAddress("N", &fSkim_N);
+    skimTree->SetBranchAddress("X", fSkim_X.data());
+    skimTree->SetBranchAddress("Alpha", fSkim_Alpha.data());
+    skimTree->SetBranchAddress("Param", fSkim_Param.data());
+    skimTree->SetBranchAddress("Cov", fSkim_Cov.data());
+    skimTree->SetBranchAddress("NSigmaProton", fSkim_NSigmaProton.data());
+    skimTree->SetBranchAddress("NSigmaPion", fSkim_NSigmaPion.data());
+    skimTree->SetBranchAddress("Label", fSkim_Label.data());
+    skimTree->SetBranchAddress("EsdIdx", fSkim_EsdIdx.data());
+}
+
+/*
+ Fill the skim tree with the daughter tracks stored in this event, then clear the buffers.
+ - Uses: `fESD`, `fMagneticField`, `fPrimaryVertex`
+*/
+void AliAnalysisQuickTask::FillSkimTree() {
+
+    fSkim_RunNumber = fESD->GetRunNumber();
+    fSkim_EventNumber = fESD->GetEventNumberInFile();
+    fSkim_MagneticField = fMagneticField;
+    fPrimaryVertex->GetXYZ(fSkim_PV);
+    fPrimaryVertex->GetCovarianceMatrix(fSkim_PVCov);
+    fSkim_N = (Int_t)fSkim_X.size();
+
+    // the buffers might have been reallocated while storing the tracks
+    SetSkimBranchAddresses(fSkimTree);
+
+    fSkimTree->Fill();
+
+    fSkim_X.clear();
+    fSkim_Alpha.clear();
+    fSkim_Param.clear();
+    fSkim_Cov.clear();
+    fSkim_NSigmaProton.clear();
+    fSkim_NSigmaPion.clear();
+    fSkim_Label.clear();
+    fSkim_EsdIdx.clear();
+}
+
+/*
+ Rerun the V0 finder straight from a skim, with no AliRoot input handler and no ESD.
+ The outputs are written into `outputFileName`, with the same layout as the analysis manager's output.
+ Note: track selection is not re-applied, as only the tracks that passed it are in the skim; the PID tagging and the V0 cuts are.
+ - Input: `inputFileName`, `outputFileName`
+*/
+void AliAnalysisQuickTask::ReplaySkim(TString inputFileName, TString outputFileName) {
+
+    TFile* inputFile = TFile::Open(inputFileName);
+    if (!inputFile || inputFile->IsZombie()) {
+        AliErrorF("!! Unable to open file %s !!", inputFileName.Data());
+        return;
+    }
+
+    TTree* skimTree = dynamic_cast<TTree*>(inputFile->Get("Skim"));
+    if (!skimTree) {
+        AliErrorF("!! Skim tree not found in %s !!", inputFileName.Data());
+        return;
+    }
+
+    // the replay reads from the skim buffers, it must not write into them
+    fWriteSkim = kFALSE;
+
+    /* Read the whole skim sequentially, through a large cache */
+
+    skimTree->SetCacheSize(256 * 1024 * 1024);
+    skimTree->AddBranchToCache("*", kTRUE);
+
+    Int_t maxN = TMath::Max((Int_t)skimTree->GetLeaf("N")->GetMaximum(), 1);
+    fSkim_X.resize(maxN);
+    fSkim_Alpha.resize(maxN);
+    fSkim_Param.resize(5 * maxN);
+    fSkim_Cov.resize(15 * maxN);
+    fSkim_NSigmaProton.resize(maxN);
+    fSkim_NSigmaPion.resize(maxN);
+    fSkim_Label.resize(maxN);
+    fSkim_EsdIdx.resize(maxN);
+
+    SetSkimBranchAddresses(skimTree);
+
+    /* Prepare output and cuts */
+
+    PrepareV0Hypotheses();
+    PrepareSVHypotheses();
+    PrepareOutputLists();
+
+    DefineTracksCuts(fCutsOption);
+    DefineV0Cuts(fCutsOption);
+    DefineSVCuts(fCutsOption);
+
+    /* Loop over events */
+
+    TStopwatch stopwatch;
+    stopwatch.Start();
+
+    Long64_t nEvents = skimTree->GetEntries();
+
+    for (Long64_t iEvent = 0; iEvent < nEvents; iEvent++) {
+
+        skimTree->GetEntry(iEvent);
+
+        AliESDVertex primaryVertex(fSkim_PV, fSkim_PVCov, 0., 0);
+        fPrimaryVertex = &primaryVertex;
+        fMagneticField = fSkim_MagneticField;
+
+        for (Int_t i = 0; i < fSkim_N; i++) {
+            AliExternalTrackParam track(fSkim_X[i], fSkim_Alpha[i], &fSkim_Param[5 * i], &fSkim_Cov[15 * i]);
+            StoreDaughter(track, fSkim_EsdIdx[i], fSkim_NSigmaProton[i], fSkim_NSigmaPion[i], fSkim_Label[i]);
+        }
+
+        KalmanV0Finder();
+
+        if (!fSVHypotheses.empty()) SecondaryVertexFinder();
+
+        fHist_Arena_UsedMemory->Fill(fArena.GetBytesInUse() / 1024.);
+
+        ClearContainers();
+
+        fParam_Arena_HighWaterMark->SetVal((Long64_t)fArena.GetHighWaterMark());
+    }  // end of loop over events
+
+    fPrimaryVertex = nullptr;
+
+    stopwatch.Stop();
+    AliInfoF("!! Replayed %lld events in %.2f s, %.1f MB read !!", nEvents, stopwatch.RealTime(), inputFile->GetBytesRead() / 1e6);
+
+    inputFile->Close();
+
+    /* Write output */
+
+    TFile outputFile(outputFileName, "RECREATE");
+    fOutputListOfTrees->Write("Trees", TObject::kSingleKey);
+    fOutputListOfHists->Write("Hists", TObject::kSingleKey);
+    outputFile.Close();
+}
+
+/*                   */
+/**  Per-File Cost  **/
+/*** ============= ***/
+
+/*
+ Reset the counters and restart the clock, at the start of an input file.
+*/
+void AliAnalysisQuickTask::StartFileCost() {
+    fCost_NEvents = 0;
+    fCost_NProcessedEvents = 0;
+    fCost_NTracks = 0;
+    fCost_NPairs = 0;
+    fCost_LogTime = 0.;
+    fCost_Stopwatch.Start(kTRUE);
+}
+
+/*
+ Store the cost of the input file that was just completed, so the next pass can be split into subjobs of similar cost.
+ The times include reading the events, as that's what a subjob pays for.
+ - Uses: `fAliEnPath`
+*/
+void AliAnalysisQuickTask::FillFileCost() {
+
+    fCost_Stopwatch.Stop();
+    fCost_RealTime = fCost_Stopwatch.RealTime();
+    fCost_CpuTime = fCost_Stopwatch.CpuTime();
+
+    strncpy(fCost_FileName, fAliEnPath.Data(), sizeof(fCost_FileName) - 1);
+    fCost_FileName[sizeof(fCost_FileName) - 1] = '\0';
+
+    fCostTree->Fill();
+
+    AliInfoF("!! %s: %lld events, %lld pairs, %.1f s !!", fCost_FileName, fCost_NEvents, fCost_NPairs, fCost_RealTime);
+}
+
+/*                 */
+/**  Checkpoints  **/
+/*** =========== ***/
+
+/*
+ Read the manifest of the input files completed by previous runs. Each line holds the input file and its partial output.
+ - Uses: `fCheckpointDir`
+ - Output: `fCheckpointedFiles`, `fCheckpointOutputs`
+*/
+void AliAnalysisQuickTask::LoadCheckpointManifest() {
+
+    fCheckpointedFiles.clear();
+    fCheckpointOutputs.clear();
+
+    gSystem->mkdir(fCheckpointDir, kTRUE);
+
+    std::ifstream manifest(Form("%s/manifest.txt", fCheckpointDir.Data()));
+    std::string inputFileName, outputFileName;
+
+    while (manifest >> inputFileName >> outputFileName) {
+        // only trust lines whose partial output is still there
+        if (gSystem->AccessPathName(Form("%s/%s", fCheckpointDir.Data(), outputFileName.c_str()))) continue;
+        fCheckpointedFiles.push_back(inputFileName.c_str());
+        fCheckpointOutputs.push_back(outputFileName.c_str());
+    }
+
+    AliInfoF("!! %i input files completed by previous runs, in %s !!", (Int_t)fCheckpointedFiles.size(), fCheckpointDir.Data());
+}
+
+/*
+ - Input: `inputFileName`
+ - Return: its partial output, relative to `fCheckpointDir`, empty if the file is not in the manifest
+*/
+TString AliAnalysisQuickTask::FindCheckpoint(TString inputFileName) {
+    auto it = std::find(fCheckpointedFiles.begin(), fCheckpointedFiles.end(), inputFileName);
+    return it != fCheckpointedFiles.end() ? fCheckpointOutputs[it - fCheckpointedFiles.begin()] : TString("");
+}
+
+/*
+ The partial output of an input file is named after the file, so a name never depends on what else is in the checkpoint directory.
+ Also used by `runAnalysis.C`, which writes the checkpoints of the parallel mode.
+ - Input: `inputFileName`
+ - Return: the name of its partial output, relative to the checkpoint directory
+*/
+TString AliAnalysisQuickTask::GetCheckpointFileName(TString inputFileName) {
+    return Form("partial_%08x.root", inputFileName.Hash());
+}
+
+/*
+ Flush what was accumulated since the last checkpoint into a partial output, with the same keys as the task's output file,
+ then reset the outputs and append the input file to the manifest. The manifest is only written once the partial output is closed,
+ so a run that dies in between simply reprocesses that file.
+ - Input: `inputFileName`, the file that was just completed
+*/
+void AliAnalysisQuickTask::WriteCheckpoint(TString inputFileName) {
+
+    TString outputFileName = GetCheckpointFileName(inputFileName);
+
+    TDirectory::TContext context;  // restore the current directory afterwards
+
+    TFile outputFile(Form("%s/%s", fCheckpointDir.Data(), outputFileName.Data()), "RECREATE");
+    if (outputFile.IsZombie()) {
+        AliErrorF("!! Couldn't write checkpoint for %s, it will be kept in memory !!", inputFileName.Data());
+        return;
+    }
+    fOutputListOfTrees->Write("Trees", TObject::kSingleKey);
+    fOutputListOfHists->Write("Hists", TObject::kSingleKey);
+    outputFile.Close();
+
+    // a single write, so the line is never interleaved with another one
+    std::ofstream manifest(Form("%s/manifest.txt", fCheckpointDir.Data()), std::ios::app);
+    manifest << Form("%s %s\n", inputFileName.Data(), outputFileName.Data()) << std::flush;
+    manifest.close();
+
+    fCheckpointedFiles.push_back(inputFileName);
+    fCheckpointOutputs.push_back(outputFileName);
+    fCheckpointsToMerge.push_back(outputFileName);
+
+    ResetOutputLists();
+
+    AliInfoF("!! Checkpoint %s written for %s !!", outputFileName.Data(), inputFileName.Data());
+}
+
+/*
+ Merge the partial outputs of the input files of this run into the output lists.
+ - Uses: `fCheckpointsToMerge`
+*/
+void AliAnalysisQuickTask::MergeCheckpoints() {
+
+    TDirectory::TContext context;
+
+    for (TString& outputFileName : fCheckpointsToMerge) {
+
+        TFile* inputFile = TFile::Open(Form("%s/%s", fCheckpointDir.Data(), outputFileName.Data()));
+        if (!inputFile || inputFile->IsZombie()) {
+            AliErrorF("!! Couldn't open checkpoint %s !!", outputFileName.Data());
+            continue;
+        }
+
+        TList* trees = dynamic_cast<TList*>(inputFile->Get("Trees"));
+        TList* hists = dynamic_cast<TList*>(inputFile->Get("Hists"));
+
+        if (trees) {
+            MergeOutputList(fOutputListOfTrees, trees);
+            trees->SetOwner(kTRUE);
+            delete trees;
+        }
+        if (hists) {
+            MergeOutputList(fOutputListOfHists, hists);
+            hists->SetOwner(kTRUE);
+            delete hists;
+        }
+
+        inputFile->Close();
+        delete inputFile;
+    }
+
+    AliInfoF("!! Merged %i checkpoints !!", (Int_t)fCheckpointsToMerge.size());
+}
+
+/*
+ Empty the histograms and trees, after they were flushed into a checkpoint.
+ The arena high-water mark is kept, as it's merged as a maximum.
+*/
+void AliAnalysisQuickTask::ResetOutputLists() {
+
+    TList* lists[2] = {fOutputListOfTrees, fOutputListOfHists};
+
+    for (TList* list : lists) {
+        TIter next(list);
+        while (TObject* obj = next()) {
+            if (obj->InheritsFrom(TH1::Class())) static_cast<TH1*>(obj)->Reset();
+            if (obj->InheritsFrom(TTree::Class())) static_cast<TTree*>(obj)->Reset();
+        }
+    }
+}
+
+/*
+ Merge each object of `source` into the object of `target` with the same name.
+ - Input: `target`, `source`
+*/
+void AliAnalysisQuickTask::MergeOutputList(TList* target, TList* source) {
+
+    TIter next(target);
+
+    while (TObject* obj = next()) {
+
+        TObject* sourceObj = source->FindObject(obj->GetName());
+        if (!sourceObj) continue;
+
+        TList toMerge;
+        toMerge.Add(sourceObj);
+
+        if (obj->InheritsFrom(TH1::Class())) {
+            static_cast<TH1*>(obj)->Merge(&toMerge);
+        } else if (obj->InheritsFrom(TTree::Class())) {
+            // the merge copies the entries through the branch addresses of `target`, which may point at buffers that are gone
+            static_cast<TTree*>(obj)->ResetBranchAddresses();
+            static_cast<TTree*>(obj)->Merge(&toMerge);
+        } else if (TParameter<Long64_t>* param = dynamic_cast<TParameter<Long64_t>*>(obj)) {
+            param->Merge(&toMerge);
+        }
+    }
+}
+
+/*                              */
+/**  Prescale -- Preview Mode  **/
+/*** ======================== ***/
+
+/*
+ In preview mode, only a deterministic fraction of the events are processed, and optionally a fraction of the daughter pairs
+ in the events with the most pairs. Every physics histogram is filled with the inverse of the sampling fractions as weight,
+ so yields and shapes are unbiased, and their errors are kept through `Sumw2()`, which is always enabled.
+ The exception is `Arena_UsedMemory`, a per-event diagnostic of the events that were actually processed, which is left unweighted.
+ The sampling only depends on the seed and on the ids of the events, so a preview is reproducible, and with both fractions set to 1
+ the task is exactly the full-statistics one.
+*/
+void AliAnalysisQuickTask::PreparePrescale() {
+
+    if (fPrescaleEvents <= 0. || fPrescaleEvents > 1.) AliFatalF("!! Invalid fraction of events %.3f !!", fPrescaleEvents);
+    if (fPrescalePairs <= 0. || fPrescalePairs > 1.) AliFatalF("!! Invalid fraction of pairs %.3f !!", fPrescalePairs);
+
+    kPrescale_MinPairs = 10000;
+
+    AliInfoF("!! Preview mode: %.3f of the events, %.3f of the pairs in events with more than %lld pairs, seed %u !!", fPrescaleEvents,
+             fPrescalePairs, kPrescale_MinPairs, fPrescaleSeed);
+}
+
+/*
+ Mix `value` into `hash`, with the finalizer of splitmix64.
+ - Return: the new hash
+*/
+ULong64_t AliAnalysisQuickTask::HashCombine(ULong64_t hash, ULong64_t value) {
+    ULong64_t z = hash ^ (value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2));
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/*
+ Decide if the current event is sampled, from the seed, the run, period, orbit, bunch crossing, the event number in its file
+ and the file itself, as MC productions don't have a meaningful orbit and bunch crossing.
+ - Uses: `fESD`, `fFileHash`, `fPrescaleSeed`, `fPrescaleEvents`
+ - Output: `fEventHash`, `fEventWeight`
+ - Return: `kTRUE` if the event is to be processed
+*/
+Bool_t AliAnalysisQuickTask::PassesEventPrescale() {
+
+    fEventHash = HashCombine(fPrescaleSeed, fESD->GetRunNumber());
+    fEventHash = HashCombine(fEventHash, fESD->GetPeriodNumber());
+    fEventHash = HashCombine(fEventHash, fESD->GetOrbitNumber());
+    fEventHash = HashCombine(fEventHash, fESD->GetBunchCrossNumber());
+    fEventHash = HashCombine(fEventHash, fESD->GetEventNumberInFile());
+    fEventHash = HashCombine(fEventHash, fFileHash);
+
+    fEventWeight = 1.;
+    if (fPrescaleEvents >= 1.) return kTRUE;
+
+    fEventWeight = 1. / fPrescaleEvents;
+    return HashToUniform(fEventHash) < fPrescaleEvents;
+}
+
+/*
+ Decide if a pair of daughters is sampled, from the event hash and the ESD indices of the daughters.
+ - Input: `esdIdxNeg`, `esdIdxPos`
+ - Return: `kTRUE` if the pair is to be tried
+*/
+Bool_t AliAnalysisQuickTask::PassesPairPrescale(Int_t esdIdxNeg, Int_t esdIdxPos) {
+    ULong64_t pairHash = HashCombine(fEventHash, ((ULong64_t)(UInt_t)esdIdxNeg << 32) | (UInt_t)esdIdxPos);
+    return HashToUniform(pairHash) < fPrescalePairs;
+}
@@ -11,6 +11,9 @@
 #include <iostream>
 #include <map>
 #include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "TArray.h"
@@ -20,11 +23,14 @@
 #include "TGrid.h"
 #include "TH1.h"
 #include "TH1F.h"
+#include "TLeaf.h"
 #include "TList.h"
 #include "TLorentzVector.h"
 #include "TObjArray.h"
 #include "TObjString.h"
+#include "TParameter.h"
 #include "TROOT.h"
+#include "TStopwatch.h"
 #include "TString.h"
 #include "TSystem.h"
 #include "TTree.h"
@@ -72,6 +78,607 @@ class KFParticleMother : public KFParticle {
     }
 };
 
+/*
+ Bump allocator that backs the transient per-event containers.
+ Memory is handed out sequentially from a list of blocks and released all at once by `Reset()`,
+ which keeps the blocks for the next event, so a long job stops allocating once the largest event has been seen.
+*/
+class QuickTaskArena {
+   public:
+    QuickTaskArena(size_t blockSize = 1 << 20) : fBlockSize(blockSize), fCurrentBlock(0), fOffset(0), fBytesInUse(0), fHighWaterMark(0) {}
+    ~QuickTaskArena() {
+        for (auto& block : fBlocks) ::operator delete(block.first);
+    }
+
+    void* Allocate(size_t bytes, size_t alignment) {
+        while (fCurrentBlock < fBlocks.size()) {
+            size_t start = (fOffset + alignment - 1) & ~(alignment - 1);
+            if (start + bytes <= fBlocks[fCurrentBlock].second) {
+                fBytesInUse += start + bytes - fOffset;
+                fOffset = start + bytes;
+                return fBlocks[fCurrentBlock].first + start;
+            }
+            fCurrentBlock++;
+            fOffset = 0;
+        }
+        // no block left with enough room, get a new one
+        size_t size = std::max(fBlockSize, bytes + alignment);
+        fBlocks.emplace_back(static_cast<char*>(::operator new(size)), size);
+        return Allocate(bytes, alignment);
+    }
+
+    void Reset() {
+        fHighWaterMark = std::max(fHighWaterMark, fBytesInUse);
+        fCurrentBlock = 0;
+        fOffset = 0;
+        fBytesInUse = 0;
+    }
+
+    size_t GetBytesInUse() const { return fBytesInUse; }
+    size_t GetHighWaterMark() const { return std::max(fHighWaterMark, fBytesInUse); }
+    size_t GetBytesReserved() const {
+        size_t reserved = 0;
+        for (auto& block : fBlocks) reserved += block.second;
+        return reserved;
+    }
+
+   private:
+    QuickTaskArena(const QuickTaskArena&);             // not implemented
+    QuickTaskArena& operator=(const QuickTaskArena&);  // not implemented
+
+    size_t fBlockSize;
+    std::vector<std::pair<char*, size_t>> fBlocks;
+    size_t fCurrentBlock;
+    size_t fOffset;
+    size_t fBytesInUse;
+    size_t fHighWaterMark;
+};
+
+/*
+ STL allocator on top of `QuickTaskArena`. Deallocation is a no-op, memory is reclaimed by `QuickTaskArena::Reset()`.
+*/
+template <typename T>
+class QuickTaskArenaAllocator {
+   public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    QuickTaskArenaAllocator(QuickTaskArena* arena = nullptr) : fArena(arena) {}
+    template <typename U>
+    QuickTaskArenaAllocator(const QuickTaskArenaAllocator<U>& other) : fArena(other.GetArena()) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(fArena->Allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
+
+    QuickTaskArena* GetArena() const { return fArena; }
+
+    template <typename U>
+    Bool_t operator==(const QuickTaskArenaAllocator<U>& other) const {
+        return fArena == other.GetArena();
+    }
+    template <typename U>
+    Bool_t operator!=(const QuickTaskArenaAllocator<U>& other) const {
+        return fArena != other.GetArena();
+    }
+
+   private:
+    QuickTaskArena* fArena;
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, QuickTaskArenaAllocator<T>>;
+typedef std::unordered_map<Int_t, Int_t, std::hash<Int_t>, std::equal_to<Int_t>, QuickTaskArenaAllocator<std::pair<const Int_t, Int_t>>> ArenaMap;
+
+/*
+ Species of V0 daughters, as tagged by the TPC PID. A daughter can be tagged as more than one species.
+*/
+enum QuickDaughterSpecies { kDaughterProton = 0, kDaughterPion, kNDaughterSpecies };
+
+/*
+ Stages of the track selection, in the order of the standard preset. Used to count the tracks surviving each cut.
+*/
+enum QuickTrackCutStage {
+    kTrackStage_Tracks = 0,
+    kTrackStage_Eta,
+    kTrackStage_NTPCClusters,
+    kTrackStage_InnerParam,
+    kTrackStage_P,
+    kTrackStage_Chi2PerNTPCClusters,
+    kNTrackCutStages
+};
+
+/*
+ Track selection cuts.
+*/
+struct QuickTrackCuts {
+    Float_t kMin_Track_P;
+    Float_t kMax_Track_P;
+    Float_t kMax_Track_Eta;
+    Float_t kMin_Track_NTPCClusters;
+    Float_t kMax_Track_Chi2PerNTPCClusters;
+
+    std::array<Long64_t, kNTrackCutStages> CutFlow;  // tracks surviving each cut in the current event
+};
+
+typedef Bool_t (*QuickTrackCutKernel)(const AliESDtrack& track, QuickTrackCuts& cuts);
+
+/*
+ Stages of the V0 selection, in the order of the lambda preset. Used to count the candidates surviving each stage.
+*/
+enum QuickV0CutStage {
+    kV0Stage_Pairs = 0,
+    kV0Stage_DCAbtwDau,
+    kV0Stage_Mass,
+    kV0Stage_Pt,
+    kV0Stage_Eta,
+    kV0Stage_Chi2ndf,
+    kV0Stage_CPAwrtPV,
+    kV0Stage_DCAwrtPV,
+    kV0Stage_DCAnegV0,
+    kV0Stage_DCAposV0,
+    kV0Stage_ArmPtOverAlpha,
+    kNV0CutStages
+};
+
+/*
+ Everything the V0 cut kernels may look at. The KF pointers are only valid after the V0 fit.
+ The DCA between daughters is computed once per pair, and only if the pair chain of one of its hypotheses cuts on it.
+*/
+struct QuickV0CutInput {
+    const KFParticleMother* kfV0;
+    const KFParticle* kfDaughterNeg;
+    const KFParticle* kfDaughterPos;
+    const TLorentzVector* lvV0;
+    const TLorentzVector* lvTrackNeg;
+    const TLorentzVector* lvTrackPos;
+    Double_t DCAbtwDau;
+    Double_t PV[3];
+};
+
+struct QuickV0Hypothesis;
+
+typedef Bool_t (*QuickV0CutKernel)(const QuickV0CutInput& input, QuickV0Hypothesis& hyp);
+
+/*
+ Decay hypothesis of the V0 finder: daughter species and masses, cut set and output histograms.
+*/
+struct QuickV0Hypothesis {
+    TString Name;
+    Int_t PdgV0;
+    Int_t PdgNeg;
+    Int_t PdgPos;
+    Int_t SpeciesNeg;
+    Int_t SpeciesPos;
+    Double_t MassNeg;
+    Double_t MassPos;
+
+    /* Cuts */
+    Float_t kMin_V0_Mass;
+    Float_t kMax_V0_Mass;
+    Float_t kMin_V0_Pt;
+    Float_t kMax_V0_Eta;
+    Float_t kMin_V0_CPAwrtPV;
+    Float_t kMax_V0_CPAwrtPV;
+    Float_t kMax_V0_DCAwrtPV;
+    Float_t kMax_V0_DCAbtwDau;
+    Float_t kMax_V0_DCAnegV0;
+    Float_t kMax_V0_DCAposV0;
+    Float_t kMax_V0_ArmPtOverAlpha;
+    Float_t kMax_V0_Chi2ndf;
+    QuickV0CutKernel PairKernel;         // applied before the transport of the daughters
+    Bool_t NeedsDCAbtwDau;               // kTRUE: `PairKernel` cuts on the DCA between daughters
+    QuickV0CutKernel KinematicKernel;    // applied before the V0 fit
+    QuickV0CutKernel TopologicalKernel;  // applied after the V0 fit
+
+    /* Output */
+    Double_t HistMinMass;
+    Double_t HistMaxMass;
+    TH1F* Hist_Mass;
+    TH1F* Hist_CutFlow;
+    std::array<Long64_t, kNV0CutStages> CutFlow;  // candidates surviving each stage in the current event
+};
+
+/*
+ A cut chain is a compile-time list of cut policies, applied in order with short-circuit and evaluated in precision `T`.
+ Each policy computes its own quantity, so a cut that is not in the chain costs nothing, not even the computation of its quantity.
+ The quantities are computed in `T` from the stored components, and compared squared or multiplied out when that saves a sqrt,
+ a division or a transcendental function; the thresholds are cast to `T` as they are.
+ Each policy counts the candidates that survive it in `thresholds.CutFlow[Cut::Stage]`.
+*/
+template <typename T, typename... Cuts>
+struct QuickCutChain;
+
+template <typename T>
+struct QuickCutChain<T> {
+    template <typename Other>
+    struct Has : std::false_type {};
+
+    template <typename Input, typename Thresholds>
+    static Bool_t Pass(const Input&, Thresholds&) {
+        return kTRUE;
+    }
+};
+
+template <typename T, typename Cut, typename... Rest>
+struct QuickCutChain<T, Cut, Rest...> {
+    // whether `Other` is in the chain, e.g. to compute a quantity shared by several chains only when one of them needs it
+    template <typename Other>
+    struct Has : std::integral_constant<Bool_t, std::is_same<Cut, Other>::value || QuickCutChain<T, Rest...>::template Has<Other>::value> {};
+
+    template <typename Input, typename Thresholds>
+    static Bool_t Pass(const Input& input, Thresholds& thresholds) {
+        if (!Cut::template Pass<T>(input, thresholds)) return kFALSE;
+        thresholds.CutFlow[Cut::Stage]++;
+        return QuickCutChain<T, Rest...>::Pass(input, thresholds);
+    }
+};
+
+/* Track Cut Policies */
+
+struct QuickTrackCut_Eta {
+    static const Int_t Stage = kTrackStage_Eta;
+    template <typename T>
+    static Bool_t Pass(const AliESDtrack& track, const QuickTrackCuts& cuts) {
+        // |eta| <= max. <=> |tan(lambda)| <= sinh(max.)
+        return TMath::Abs((T)track.GetTgl()) <= (T)TMath::SinH(cuts.kMax_Track_Eta);
+    }
+};
+
+struct QuickTrackCut_NTPCClusters {
+    static const Int_t Stage = kTrackStage_NTPCClusters;
+    template <typename T>
+    static Bool_t Pass(const AliESDtrack& track, const QuickTrackCuts& cuts) {
+        return (T)track.GetTPCNcls() >= (T)cuts.kMin_Track_NTPCClusters;
+    }
+};
+
+struct QuickTrackCut_InnerParam {
+    static const Int_t Stage = kTrackStage_InnerParam;
+    template <typename T>
+    static Bool_t Pass(const AliESDtrack& track, const QuickTrackCuts&) {
+        return track.GetInnerParam() != nullptr;
+    }
+};
+
+// requires `QuickTrackCut_InnerParam` before it in the chain
+struct QuickTrackCut_P {
+    static const Int_t Stage = kTrackStage_P;
+    template <typename T>
+    static Bool_t Pass(const AliESDtrack& track, const QuickTrackCuts& cuts) {
+        T P = track.GetInnerParam()->GetP();
+        return P >= (T)cuts.kMin_Track_P && P <= (T)cuts.kMax_Track_P;
+    }
+};
+
+struct QuickTrackCut_Chi2PerNTPCClusters {
+    static const Int_t Stage = kTrackStage_Chi2PerNTPCClusters;
+    template <typename T>
+    static Bool_t Pass(const AliESDtrack& track, const QuickTrackCuts& cuts) {
+        return (T)track.GetTPCchi2() <= (T)cuts.kMax_Track_Chi2PerNTPCClusters * (T)track.GetTPCNcls();
+    }
+};
+
+/* V0 Cut Policies -- Before the Transport */
+
+// reads the DCA computed once per pair, see `QuickV0CutInput`
+struct QuickV0Cut_DCAbtwDau {
+    static const Int_t Stage = kV0Stage_DCAbtwDau;
+    template <typename T>
+    static Bool_t Pass(const QuickV0CutInput& input, const QuickV0Hypothesis& hyp) {
+        return TMath::Abs((T)input.DCAbtwDau) <= (T)hyp.kMax_V0_DCAbtwDau;
+    }
+};
+
+/* V0 Cut Policies -- Before the Fit */
+
+struct QuickV0Cut_Mass {
+    static const Int_t Stage = kV0Stage_Mass;
+    template <typename T>
+    static Bool_t Pass(const QuickV0CutInput& input, const QuickV0Hypothesis& hyp) {
+        T E = input.lvV0->E();
+        T Px = input.lvV0->Px();
+        T Py = input.lvV0->Py();
+        T Pz = input.lvV0->Pz();
+        T Mass2 = E * E - Px * Px - Py * Py - Pz * Pz;
+        return Mass2 >= (T)hyp.kMin_V0_Mass * (T)hyp.kMin_V0_Mass && Mass2 <= (T)hyp.kMax_V0_Mass * (T)hyp.kMax_V0_Mass;
+    }
+};
+
+struct QuickV0Cut_Pt {
+    static const Int_t Stage = kV0Stage_Pt;
+    template <typename T>
+    static Bool_t Pass(const QuickV0CutInput& input, const QuickV0Hypothesis& hyp) {
+        T Px = input.lvV0->Px();
+        T Py = input.lvV0->Py();
+        return Px * Px + Py * Py >= (T)hyp.kMin_V0_Pt * (T)hyp.kMin_V0_Pt;
+    }
+};
+
+struct QuickV0Cut_Eta {
+    static const Int_t Stage = kV0Stage_Eta;
+    template <typename T>
+    static Bool_t Pass(const QuickV0CutInput& input, const QuickV0Hypothesis& hyp) {
+        // |eta| <= max. <=> |pz| <= pt * sinh(max.)
+        T Px = input.lvV0->Px();
+        T Py = input.lvV0->Py();
+        T Pz = input.lvV0->Pz();
+        T SinhMaxEta = TMath::SinH(hyp.kMax_V0_Eta);
+        return Pz * Pz <= (Px * Px + Py * Py) * SinhMaxEta * SinhMaxEta;
+    }
+};
+
+/* V0 Cut Policies -- After the Fit */
+
+struct QuickV0Cut_Chi2ndf {
+    static const Int_t Stage = kV0Stage_Chi2ndf;
+    template <typename T>
+    static Bool_t Pass(const QuickV0CutInput& input, const QuickV0Hypothesis& hyp) {
+        return (T)input.kfV0->GetChi2() <= (T)hyp.kMax_V0_Chi2ndf * (T)input.kfV0->GetNDF();
+    }
+};
+
+struct QuickV0Cut_CPAwrtPV {
+    static const Int_t Stage = kV0Stage_CPAwrtPV;
+    template <typename T>
+    static Bool_t Pass(const QuickV0CutInput& input, const QuickV0Hypothesis& hyp) {
+        T dX = (T)input.kfV0->GetX() - (T)input.PV[0];
+        T dY = (T)input.kfV0->GetY() - (T)input.PV[1];
+        T dZ = (T)input.kfV0->GetZ() - (T)input.PV[2];
+        T Px = input.lvV0->Px();
+        T Py = input.lvV0->Py();
+        T Pz = input.lvV0->Pz();
+        T CPAwrtPV = (dX * Px + dY * Py + dZ * Pz) / TMath::Sqrt((dX * dX + dY * dY + dZ * dZ) * (Px * Px + Py * Py + Pz * Pz));
+        return CPAwrtPV >= (T)hyp.kMin_V0_CPAwrtPV && CPAwrtPV <= (T)hyp.kMax_V0_CPAwrtPV;
+    }
+};
+
+struct QuickV0Cut_DCAwrtPV {
+    static const Int_t Stage = kV0Stage_DCAwrtPV;
+    template <typename T>
+    static Bool_t Pass(const QuickV0CutInput& input, const QuickV0Hypothesis& hyp) {
+        T dX = (T)input.PV[0] - (T)input.kfV0->GetX();
+        T dY = (T)input.PV[1] - (T)input.kfV0->GetY();
+        T dZ = (T)input.PV[2] - (T)input.kfV0->GetZ();
+        T Px = input.lvV0->Px();
+        T Py = input.lvV0->Py();
+        T Pz = input.lvV0->Pz();
+        T CrossX = dY * Pz - dZ * Py;
+        T CrossY = dZ * Px - dX * Pz;
+        T CrossZ = dX * Py - dY * Px;
+        T DCAwrtPV2 = (CrossX * CrossX + CrossY * CrossY + CrossZ * CrossZ) / (Px * Px + Py * Py + Pz * Pz);
+        return DCAwrtPV2 <= (T)hyp.kMax_V0_DCAwrtPV * (T)hyp.kMax_V0_DCAwrtPV;
+    }
+};
+
+struct QuickV0Cut_DCAnegV0 {
+    static const Int_t Stage = kV0Stage_DCAnegV0;
+    template <typename T>
+    static Bool_t Pass(const QuickV0CutInput& input, const QuickV0Hypothesis& hyp) {
+        return TMath::Abs((T)input.kfDaughterNeg->GetDistanceFromVertex(*input.kfV0)) <= (T)hyp.kMax_V0_DCAnegV0;
+    }
+};
+
+struct QuickV0Cut_DCAposV0 {
+    static const Int_t Stage = kV0Stage_DCAposV0;
+    template <typename T>
+    static Bool_t Pass(const QuickV0CutInput& input, const QuickV0Hypothesis& hyp) {
+        return TMath::Abs((T)input.kfDaughterPos->GetDistanceFromVertex(*input.kfV0)) <= (T)hyp.kMax_V0_DCAposV0;
+    }
+};
+
+struct QuickV0Cut_ArmPtOverAlpha {
+    static const Int_t Stage = kV0Stage_ArmPtOverAlpha;
+    template <typename T>
+    static Bool_t Pass(const QuickV0CutInput& input, const QuickV0Hypothesis& hyp) {
+        T Px = input.lvV0->Px();
+        T Py = input.lvV0->Py();
+        T Pz = input.lvV0->Pz();
+        T P = TMath::Sqrt(Px * Px + Py * Py + Pz * Pz);
+        T lQlNeg = ((T)input.lvTrackNeg->Px() * Px + (T)input.lvTrackNeg->Py() * Py + (T)input.lvTrackNeg->Pz() * Pz) / P;
+        T lQlPos = ((T)input.lvTrackPos->Px() * Px + (T)input.lvTrackPos->Py() * Py + (T)input.lvTrackPos->Pz() * Pz) / P;
+        T ArmAlpha = lQlPos + lQlNeg == 0 ? (T)2 : (lQlPos - lQlNeg) / (lQlPos + lQlNeg);  // (protection)
+        T PNeg2 = (T)input.lvTrackNeg->Px() * input.lvTrackNeg->Px() + (T)input.lvTrackNeg->Py() * input.lvTrackNeg->Py() +
+                  (T)input.lvTrackNeg->Pz() * input.lvTrackNeg->Pz();
+        T ArmPt = TMath::Sqrt(TMath::Max(PNeg2 - lQlNeg * lQlNeg, (T)0));
+        return TMath::Abs(ArmPt / ArmAlpha) <= (T)hyp.kMax_V0_ArmPtOverAlpha;
+    }
+};
+
+/*
+ Cut presets, i.e., the chains that can be selected at runtime, all instantiated at compile time.
+ Within each chain, cuts are ordered by expected rejection power per unit of cost: the mass window rejects most of the combinatorics
+ before the fit, and after the fit the chi2 comes for free, while the pointing cuts reject more than the daughters' DCAs.
+*/
+enum QuickTrackCutPreset { kTrackPreset_Standard = 0, kTrackPreset_Loose, kNTrackCutPresets };
+
+template <typename T>
+struct QuickTrackPreset_Standard {
+    typedef QuickCutChain<T, QuickTrackCut_Eta, QuickTrackCut_NTPCClusters, QuickTrackCut_InnerParam, QuickTrackCut_P,
+                          QuickTrackCut_Chi2PerNTPCClusters>
+        Chain;
+};
+
+template <typename T>
+struct QuickTrackPreset_Loose {
+    typedef QuickCutChain<T, QuickTrackCut_Eta, QuickTrackCut_InnerParam> Chain;
+};
+
+enum QuickV0CutPreset { kV0Preset_Lambda = 0, kV0Preset_KaonZeroShort, kV0Preset_Open, kNV0CutPresets };
+
+template <typename T>
+struct QuickV0Preset_Lambda {
+    typedef QuickCutChain<T, QuickV0Cut_DCAbtwDau> Pair;
+    typedef QuickCutChain<T, QuickV0Cut_Mass, QuickV0Cut_Pt, QuickV0Cut_Eta> Kinematic;
+    typedef QuickCutChain<T, QuickV0Cut_Chi2ndf, QuickV0Cut_CPAwrtPV, QuickV0Cut_DCAwrtPV, QuickV0Cut_DCAnegV0, QuickV0Cut_DCAposV0,
+                          QuickV0Cut_ArmPtOverAlpha>
+        Topological;
+};
+
+// the Armenteros cut of the lambda preset is meant to reject K0S
+template <typename T>
+struct QuickV0Preset_KaonZeroShort {
+    typedef QuickCutChain<T, QuickV0Cut_DCAbtwDau> Pair;
+    typedef QuickCutChain<T, QuickV0Cut_Mass, QuickV0Cut_Pt, QuickV0Cut_Eta> Kinematic;
+    typedef QuickCutChain<T, QuickV0Cut_Chi2ndf, QuickV0Cut_CPAwrtPV, QuickV0Cut_DCAwrtPV, QuickV0Cut_DCAnegV0, QuickV0Cut_DCAposV0>
+        Topological;
+};
+
+// only the mass window, to study the topological variables
+template <typename T>
+struct QuickV0Preset_Open {
+    typedef QuickCutChain<T> Pair;
+    typedef QuickCutChain<T, QuickV0Cut_Mass> Kinematic;
+    typedef QuickCutChain<T> Topological;
+};
+
+/*
+ V0 candidate accepted by `KalmanV0Finder()`, kept for the secondary-vertex stage.
+*/
+struct QuickV0Candidate {
+    Int_t Hypothesis;  // index in the table of V0 hypotheses
+    Int_t EsdIdxNeg;
+    Int_t EsdIdxPos;
+    KFParticle KF;  // fitted V0, at its decay vertex
+};
+
+/*
+ Compact copy of a daughter track, kept in the event-mixing pool. The position is relative to the primary vertex of its event,
+ so it can be moved to the primary vertex of the event it's mixed with.
+*/
+struct QuickMixingTrack {
+    Float_t Param[6];  // KFParticle parameters
+    Float_t Cov[21];   // KFParticle covariance
+    Int_t Charge;
+};
+
+/*
+ Stages of the secondary-vertex selection, in the order they are applied.
+*/
+enum QuickSVCutStage {
+    kSVStage_AllPairs = 0,  // all combinations, as a naive double loop would try
+    kSVStage_GridPairs,     // combinations found compatible by the spatial index
+    kSVStage_SharedDau,
+    kSVStage_DCAbtwDau,
+    kSVStage_DistanceFromPV,
+    kSVStage_Mass,
+    kSVStage_Pt,
+    kSVStage_CPAwrtPV,
+    kSVStage_DCAwrtPV,
+    kSVStage_Chi2ndf,
+    kNSVCutStages
+};
+
+/*
+ Hypothesis of the secondary-vertex finder: a V0 combined with either another V0 or a selected daughter track.
+*/
+struct QuickSVHypothesis {
+    TString Name;
+    Int_t FirstV0;      // index in the table of V0 hypotheses
+    Int_t SecondV0;     // index in the table of V0 hypotheses, -1 if the second daughter is a track
+    Int_t TrackCharge;  // only if the second daughter is a track
+    Int_t TrackSpecies;
+
+    /* Cuts */
+    Float_t kMin_SV_Mass;
+    Float_t kMax_SV_Mass;
+    Float_t kMin_SV_Pt;
+    Float_t kMin_SV_CPAwrtPV;
+    Float_t kMax_SV_DCAwrtPV;
+    Float_t kMax_SV_DCAbtwDau;
+    Float_t kMax_SV_Chi2ndf;
+    Float_t kMin_SV_DistanceFromPV;  // on the fitted vertex, 0 to disable; the spatial index leaves out the same sphere
+
+    /* Output */
+    Double_t HistMinMass;
+    Double_t HistMaxMass;
+    TH1F* Hist_Mass;
+    TH1F* Hist_CutFlow;
+    std::array<Long64_t, kNSVCutStages> CutFlow;  // candidates surviving each stage in the current event
+    Double_t Weight;                              // prescale weight of the candidates in the current event
+};
+
+/*
+ Per-event uniform 3D grid of linearized trajectories, used to find the pairs of objects that may share a vertex.
+ Each object is inserted in all the cells crossed by a straight segment, and the pairs are searched for in the cells crossed by
+ another segment and their neighbours, so the cell size acts as the spatial tolerance. Backed by the per-event arena.
+*/
+class QuickSpatialGrid {
+   public:
+    QuickSpatialGrid() : fCellSize(1.) {}
+
+    void Clear(QuickTaskArena* arena, Float_t cellSize) {
+        QuickTaskArenaAllocator<Int_t> allocator(arena);
+        fHeads = ArenaMap(allocator);
+        fObjects = ArenaVector<Int_t>(allocator);
+        fNext = ArenaVector<Int_t>(allocator);
+        fCellSize = cellSize;
+    }
+
+    void Insert(Int_t object, const Double_t start[3], const Double_t end[3]) {
+        Int_t previousKey = -1;
+        Int_t cell[3];
+        Int_t nSteps = GetNSteps(start, end);
+        for (Int_t step = 0; step <= nSteps; step++) {
+            GetCell(start, end, step, nSteps, cell);
+            Int_t key = GetKey(cell[0], cell[1], cell[2]);
+            if (key < 0 || key == previousKey) continue;
+            previousKey = key;
+            ArenaMap::iterator head = fHeads.find(key);
+            fObjects.push_back(object);
+            fNext.push_back(head == fHeads.end() ? -1 : head->second);
+            fHeads[key] = (Int_t)fObjects.size() - 1;
+        }
+    }
+
+    /* Call `visit(object)` for each object found around the segment. The same object can be visited more than once. */
+    template <typename Visitor>
+    void Query(const Double_t start[3], const Double_t end[3], Visitor visit) const {
+        Int_t previousCell[3] = {kMaxInt, kMaxInt, kMaxInt};
+        Int_t cell[3];
+        Int_t nSteps = GetNSteps(start, end);
+        for (Int_t step = 0; step <= nSteps; step++) {
+            GetCell(start, end, step, nSteps, cell);
+            if (cell[0] == previousCell[0] && cell[1] == previousCell[1] && cell[2] == previousCell[2]) continue;
+            std::copy(cell, cell + 3, previousCell);
+            for (Int_t dx = -1; dx <= 1; dx++) {
+                for (Int_t dy = -1; dy <= 1; dy++) {
+                    for (Int_t dz = -1; dz <= 1; dz++) {
+                        ArenaMap::const_iterator head = fHeads.find(GetKey(cell[0] + dx, cell[1] + dy, cell[2] + dz));
+                        if (head == fHeads.end()) continue;
+                        for (Int_t entry = head->second; entry >= 0; entry = fNext[entry]) visit(fObjects[entry]);
+                    }
+                }
+            }
+        }
+    }
+
+   private:
+    static const Int_t kHalfRange = 512;  // cells per half-axis, 10 bits per axis
+
+    Int_t GetNSteps(const Double_t start[3], const Double_t end[3]) const {
+        Double_t length = TMath::Sqrt((end[0] - start[0]) * (end[0] - start[0]) + (end[1] - start[1]) * (end[1] - start[1]) +
+                                      (end[2] - start[2]) * (end[2] - start[2]));
+        return (Int_t)TMath::Ceil(2. * length / fCellSize);  // sample every half cell
+    }
+
+    void GetCell(const Double_t start[3], const Double_t end[3], Int_t step, Int_t nSteps, Int_t cell[3]) const {
+        Double_t t = nSteps ? (Double_t)step / nSteps : 0.;
+        for (Int_t i = 0; i < 3; i++) cell[i] = (Int_t)TMath::Floor((start[i] + t * (end[i] - start[i])) / fCellSize);
+    }
+
+    Int_t GetKey(Int_t ix, Int_t iy, Int_t iz) const {
+        if (TMath::Abs(ix) >= kHalfRange || TMath::Abs(iy) >= kHalfRange || TMath::Abs(iz) >= kHalfRange) return -1;
+        return ((ix + kHalfRange) << 20) | ((iy + kHalfRange) << 10) | (iz + kHalfRange);
+    }
+
+    Float_t fCellSize;
+    ArenaMap fHeads;              // cell key -> last entry in that cell
+    ArenaVector<Int_t> fObjects;  // entry -> object
+    ArenaVector<Int_t> fNext;     // entry -> previous entry in the same cell, -1 if none
+};
+
 class AliAnalysisQuickTask : public AliAnalysisTaskSE {
    public:
     AliAnalysisQuickTask();
@@ -79,27 +686,76 @@ class AliAnalysisQuickTask : public AliAnalysisTaskSE {
     virtual ~AliAnalysisQuickTask();
 
     virtual void UserCreateOutputObjects();
+    void PrepareOutputLists();
     void PrepareTracksHistograms();
     virtual void UserExec(Option_t* option);
-    virtual void Terminate(Option_t* option) { return; }
+    virtual void Terminate(Option_t* option);
     virtual Bool_t UserNotify();
+    virtual void FinishTaskOutput();
+
+    /* Per-File Cost */
+    void StartFileCost();
+    void FillFileCost();
 
-    /* MC Generated */
+    /* Prescale */
+    void SetPrescale(Float_t eventFraction, Float_t pairFraction, UInt_t seed) {
+        fPrescaleEvents = eventFraction;
+        fPrescalePairs = pairFraction;
+        fPrescaleSeed = seed;
+    }
+    void PreparePrescale();
+    static ULong64_t HashCombine(ULong64_t hash, ULong64_t value);
+    static Double_t HashToUniform(ULong64_t hash) { return (hash >> 11) * (1. / 9007199254740992.); }  // [0, 1), 53 bits
+    Bool_t PassesEventPrescale();
+    Bool_t PassesPairPrescale(Int_t esdIdxNeg, Int_t esdIdxPos);
+
+    /* MC */
+    void SetProcessFullMCStack(Bool_t processFullMCStack) { fProcessFullMCStack = processFullMCStack; }
     void ProcessMCGen();
+    void ResolveMCLabels();
 
     /* Cuts */
+    void SetCutsOption(TString cutsOption) { fCutsOption = cutsOption; }
     void DefineTracksCuts(TString cuts_option);
     void DefineV0Cuts(TString cuts_option);
+    static QuickTrackCutKernel GetTrackCutKernel(Int_t preset, Bool_t singlePrecision);
+    static void GetV0CutKernels(Int_t preset, Bool_t singlePrecision, QuickV0CutKernel& pairKernel, QuickV0CutKernel& kinematicKernel,
+                                QuickV0CutKernel& topologicalKernel);
+    static Bool_t V0PresetNeedsDCAbtwDau(Int_t preset);
 
     /* Tracks */
     void ProcessTracks();
     Bool_t PassesTrackSelection(AliESDtrack* track);
+    Bool_t StoreDaughter(AliExternalTrackParam& track, Int_t esdIdxTrack, Float_t nSigmaProton, Float_t nSigmaPion, Int_t mcLabel);
     void PlotStatus(AliESDtrack* track);
 
     /* V0s */
+    void SetV0Hypotheses(TString hypotheses) { fV0HypothesesOption = hypotheses; }
+    void PrepareV0Hypotheses();
+    void AddV0Hypothesis(TString name, Int_t pdgV0, Int_t pdgNeg, Int_t pdgPos, Double_t histMinMass, Double_t histMaxMass);
+    Int_t GetDaughterSpecies(Int_t pdgCode);
     void KalmanV0Finder();
-    Bool_t PassesV0Cuts(KFParticleMother kfV0, KFParticle kfDaughterNeg, KFParticle kfDaughterPos, TLorentzVector lvV0, TLorentzVector lvTrackNeg,
-                        TLorentzVector lvTrackPos);
+
+    /* Event Mixing */
+    void SetEventMixing(TString hypothesis, Int_t depth) {
+        fMixingHypothesisOption = hypothesis;
+        fMixingDepth = TMath::Max(depth, 0);  // a negative depth disables it too
+    }
+    void PrepareEventMixing();
+    Int_t GetMixingBin();
+    void EventMixing();
+    void AddEventToMixingPool(Int_t bin);
+
+    /* Secondary Vertices -- V0+V0 and V0+Track */
+    void SetSVHypotheses(TString hypotheses) { fSVHypothesesOption = hypotheses; }
+    void PrepareSVHypotheses();
+    void AddSVHypothesis(TString name, TString nameFirstV0, TString nameSecondV0, Int_t pdgSecondTrack, Double_t histMinMass, Double_t histMaxMass);
+    Int_t FindV0Hypothesis(TString name);
+    void DefineSVCuts(TString cuts_option);
+    void SecondaryVertexFinder();
+    Bool_t GetUpstreamSegment(const KFParticle& kfParticle, Float_t minDistanceFromPV, Double_t start[3], Double_t end[3]);
+    Bool_t GetDownstreamSegment(const KFParticle& kfParticle, Float_t minDistanceFromPV, Double_t start[3], Double_t end[3]);
+    Bool_t PassesSVCuts(QuickSVHypothesis& hyp, const KFParticleMother& kfSV);
 
     /* Mathematical Functions */
     Double_t CosinePointingAngle(TLorentzVector lvParticle, Double_t X, Double_t Y, Double_t Z, Double_t refPointX, Double_t refPointY,
@@ -113,11 +769,31 @@ class AliAnalysisQuickTask : public AliAnalysisTaskSE {
     /* Kalman Filter Utilities */
     KFParticle CreateKFParticle(AliExternalTrackParam& track, Double_t mass, Int_t charge);
     KFVertex CreateKFVertex(const AliVVertex& vertex);
-    KFParticle TransportKFParticle(KFParticle kfThis, KFParticle kfOther, Int_t pdgThis, Int_t chargeThis);
+    KFParticle TransportKFParticle(const KFParticle& kfThis, const KFParticle& kfOther, Double_t massThis, Int_t chargeThis);
 
     /* External Files */
     Bool_t LoadLogsIntoTree();
 
+    /* Per-Event Memory */
+    void ClearContainers();
+
+    /* Skim of Daughter Tracks */
+    void SetWriteSkim(Bool_t writeSkim);
+    void PrepareSkimTree();
+    void SetSkimBranchAddresses(TTree* skimTree);
+    void FillSkimTree();
+    void ReplaySkim(TString inputFileName, TString outputFileName);
+
+    /* Checkpoints */
+    void SetCheckpointDir(TString checkpointDir) { fCheckpointDir = checkpointDir; }
+    void LoadCheckpointManifest();
+    TString FindCheckpoint(TString inputFileName);
+    static TString GetCheckpointFileName(TString inputFileName);
+    void WriteCheckpoint(TString inputFileName);
+    void MergeCheckpoints();
+    void ResetOutputLists();
+    static void MergeOutputList(TList* target, TList* source);
+
    private:
     /* AliRoot Objects */
     AliMCEvent* fMC;                //! MC event
@@ -127,6 +803,33 @@ class AliAnalysisQuickTask : public AliAnalysisTaskSE {
     AliESDVertex* fPrimaryVertex;   //! primary vertex
     Double_t fMagneticField;        //! magnetic field
 
+    /* Prescale Options -- preview mode */
+    Float_t fPrescaleEvents;  // fraction of events processed, 1 to process all of them
+    Float_t fPrescalePairs;   // fraction of V0 daughter pairs tried in events with more than `kPrescale_MinPairs` pairs, 1 to try all of them
+    UInt_t fPrescaleSeed;     // changes the sampled events and pairs, not their number
+
+    /* MC Options */
+    Bool_t fProcessFullMCStack;  // kTRUE: walk the whole MC stack each event, kFALSE: resolve only labels of selected tracks
+
+    /* Skim Options */
+    Bool_t fWriteSkim;  // kTRUE: write the selected daughter tracks into output slot 3
+
+    /* Cuts Options */
+    TString fCutsOption;  // "loose": loose track cuts, "open": only the V0 mass window, "float": evaluate cuts in single precision
+
+    /* Checkpoint Options */
+    TString fCheckpointDir;  // where to flush the outputs after each input file, and the manifest of those files, empty to disable
+
+    /* V0 Options */
+    TString fV0HypothesesOption;  // comma-separated list of V0 decay hypotheses, e.g. "AntiLambda,Lambda,KaonZeroShort"
+
+    /* Event Mixing Options */
+    TString fMixingHypothesisOption;  // V0 hypothesis to build the mixed-event background for, e.g. "AntiLambda"
+    Int_t fMixingDepth;               // number of pooled events each event is mixed with, 0 to disable
+
+    /* Secondary Vertices Options */
+    TString fSVHypothesesOption;  // comma-separated list of secondary-vertex hypotheses, e.g. "AntiSexaquarkA,AntiXiPlus", empty to disable
+
     /* ROOT Objects */
     TDatabasePDG fPDG;          //!
     TList* fOutputListOfTrees;  //!
@@ -142,39 +845,100 @@ class AliAnalysisQuickTask : public AliAnalysisTaskSE {
     TH1F* fHist_Tracks_NSigmaPion;    //!
     TH1F* fHist_Tracks_Eta;           //!
     TH1F* fHist_Tracks_Status;        //!
-    TH1F* fHist_AntiLambda_Mass;      //!
+    TH1F* fHist_Tracks_CutFlow;       //!
+
+    /* V0 Hypotheses */
+    std::vector<QuickV0Hypothesis> fV0Hypotheses;  //! built from `fV0HypothesesOption`
+    Double_t fDaughterMass[kNDaughterSpecies];     //!
+    UChar_t fSpeciesOfNegDaughters;                //! species needed by at least one hypothesis, as bit masks
+    UChar_t fSpeciesOfPosDaughters;                //!
+
+    /* Per-File Cost -- read by `planSplitting.C` */
+    TTree* fCostTree;                 //! one entry per input file
+    Char_t fCost_FileName[1024];      //!
+    Long64_t fCost_NEvents;           //! events read
+    Long64_t fCost_NProcessedEvents;  //! events that went through the reconstruction
+    Long64_t fCost_NTracks;           //! selected daughters
+    Long64_t fCost_NPairs;            //! daughter pairs, the V0 finder is quadratic in the selected daughters
+    Double_t fCost_LogTime;           //! spent in `LoadLogsIntoTree()`, in s
+    Double_t fCost_RealTime;          //! in s
+    Double_t fCost_CpuTime;           //! in s
+    TStopwatch fCost_Stopwatch;       //!
+
+    /* Prescale */
+    ULong64_t fFileHash;          //! identifies the current input file, from its directory name
+    ULong64_t fEventHash;         //! identifies the current event, from the seed, its ids and its file
+    Double_t fEventWeight;        //! 1 / fraction of sampled events
+    Double_t fPairWeight;         //! 1 / fraction of sampled pairs in the current event
+    Long64_t kPrescale_MinPairs;  //!
+
+    /* Event Mixing */
+    QuickV0Hypothesis fMixingHypothesis;        //! copy of the mixed hypothesis, with its own cut flow and output
+    std::vector<QuickMixingTrack> fMixingPool;  //! [bin][slot][track], allocated once
+    std::vector<Int_t> fMixingPoolNTracks;      //! [bin][slot]
+    std::vector<Int_t> fMixingPoolNEvents;      //! [bin], number of filled slots
+    std::vector<Int_t> fMixingPoolNextSlot;     //! [bin], oldest slot, the next to be overwritten
+    Int_t kMixing_NBinsZ;                       //!
+    Float_t kMixing_MaxAbsZ;                    //! in cm
+    std::vector<Int_t> kMixing_MultEdges;       //! in number of ESD tracks
+    Int_t kMixing_MaxTracksPerEvent;            //! per charge, both when pooling and when mixing
+
+    /* Secondary-Vertex Hypotheses */
+    std::vector<QuickSVHypothesis> fSVHypotheses;  //! built from `fSVHypothesesOption`
+    Float_t kGrid_CellSize;                        //! spatial tolerance of the index, in cm
+    Float_t kGrid_SegmentLength;                   //! length of the linearized trajectories, in cm
+
+    /* Checkpoints */
+    std::vector<TString> fCheckpointedFiles;   //! input files already in the manifest
+    std::vector<TString> fCheckpointOutputs;   //! their partial outputs, relative to `fCheckpointDir`
+    std::vector<TString> fCheckpointsToMerge;  //! the partial outputs of the input files of this run
+    Bool_t fSkipCurrentFile;                   //! kTRUE: the current input file was completed by a previous run
+
+    /* Per-Event Memory Bookkeeping */
+    TH1F* fHist_Arena_UsedMemory;                      //! memory used by the per-event containers, in kB, unweighted
+    TParameter<Long64_t>* fParam_Arena_HighWaterMark;  //! max. memory used by the per-event containers, in bytes
 
     /* Containers -- Vectors and Hash Tables */
-    std::unordered_map<Int_t, Int_t> getPdgCode_fromMcIdx;  //
-    std::vector<Int_t> esdIndicesOfAntiProtonTracks;        //
-    std::vector<Int_t> esdIndicesOfPiPlusTracks;            //
+    QuickTaskArena fArena;                         //! backs all containers below, reset at the end of each event
+    ArenaMap getPdgCode_fromMcIdx;                 //! generated particles of interest, from `ProcessMCGen()`
+    ArenaMap getAncestorPdgCode_fromMcIdx;         //! selected tracks and their ancestors, from `ResolveMCLabels()`
+    ArenaMap getMotherMcIdx_fromMcIdx;             //!
+    ArenaVector<Int_t> mcIndicesOfSelectedTracks;  //!
+    ArenaVector<Int_t> esdIndicesOfNegTracks;      //!
+    ArenaVector<Int_t> esdIndicesOfPosTracks;      //!
+    ArenaVector<UChar_t> speciesOfNegTracks;       //! bit mask of `QuickDaughterSpecies`, same order as `esdIndicesOfNegTracks`
+    ArenaVector<UChar_t> speciesOfPosTracks;       //!
+    ArenaVector<KFParticle> kfNegTracks;           //! KF scratch, `kNDaughterSpecies` entries per track, one per mass hypothesis
+    ArenaVector<KFParticle> kfPosTracks;           //!
+    ArenaVector<QuickV0Candidate> acceptedV0s;     //! only filled when the secondary-vertex stage is enabled
+    QuickSpatialGrid svGrid;                       //!
+
+    /* Skim -- Tree and Buffers */
+    TTree* fSkimTree;                         //! one entry per event
+    Int_t fSkim_RunNumber;                    //!
+    Int_t fSkim_EventNumber;                  //! event number in file
+    Double_t fSkim_MagneticField;             //!
+    Double_t fSkim_PV[3];                     //! primary vertex position
+    Double_t fSkim_PVCov[6];                  //! primary vertex covariance
+    Int_t fSkim_N;                            //! number of stored daughter tracks
+    std::vector<Double_t> fSkim_X;            //! `AliExternalTrackParam` state, one per track
+    std::vector<Double_t> fSkim_Alpha;        //!
+    std::vector<Double_t> fSkim_Param;        //! 5 per track
+    std::vector<Double_t> fSkim_Cov;          //! 15 per track
+    std::vector<Float_t> fSkim_NSigmaProton;  //!
+    std::vector<Float_t> fSkim_NSigmaPion;    //!
+    std::vector<Int_t> fSkim_Label;           //!
+    std::vector<Int_t> fSkim_EsdIdx;          //!
 
     /* Cuts -- Track Selection */
-    Float_t kMin_Track_P;                    //
-    Float_t kMax_Track_P;                    //
-    Float_t kMax_Track_Eta;                  //
-    Float_t kMin_Track_NTPCClusters;         //
-    Float_t kMax_Track_Chi2PerNTPCClusters;  //
-
-    /* Cuts -- V0 Selection */
-    Float_t kMin_V0_Mass;            //
-    Float_t kMax_V0_Mass;            //
-    Float_t kMin_V0_Pt;              //
-    Float_t kMax_V0_Eta;             //
-    Float_t kMin_V0_CPAwrtPV;        //
-    Float_t kMax_V0_CPAwrtPV;        //
-    Float_t kMax_V0_DCAwrtPV;        //
-    Float_t kMax_V0_DCAbtwDau;       //
-    Float_t kMax_V0_DCAnegV0;        //
-    Float_t kMax_V0_DCAposV0;        //
-    Float_t kMax_V0_ArmPtOverAlpha;  //
-    Float_t kMax_V0_Chi2ndf;         //
+    QuickTrackCuts fTrackCuts;            //!
+    QuickTrackCutKernel fTrackCutKernel;  //!
 
     AliAnalysisQuickTask(const AliAnalysisQuickTask&);             // not implemented
     AliAnalysisQuickTask& operator=(const AliAnalysisQuickTask&);  // not implemented
 
     /// \cond CLASSDEF
-    ClassDef(AliAnalysisQuickTask, 6);
+    ClassDef(AliAnalysisQuickTask, 15);
     /// \endcond
 };
 